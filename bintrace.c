@@ -0,0 +1,267 @@
+/* Recording and loading of binary traces, see bintrace.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bintrace.h"
+
+static const char bt_magic[4] = {'Q', 'T', 'B', '1'};
+
+/* Output buffering for the recorded file */
+#define BT_IOBUF_SIZE (1 << 16)
+
+/*
+ * Recording state.
+ * Strings are interned in an open-addressing table of indices into strs,
+ * kept at most half full.
+ */
+static FILE *out = NULL;
+static bool out_failed = false;
+static char **strs = NULL;
+static size_t nstrs = 0;
+static size_t *slots = NULL;
+static size_t nslots = 0;
+
+/* FNV-1a hash of a string */
+static uint64_t str_fnv(const char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+    return h;
+}
+
+static void put_varint(uint64_t v)
+{
+    while (v >= 0x80) {
+        putc((int) (v & 0x7f) | 0x80, out);
+        v >>= 7;
+    }
+    putc((int) v, out);
+}
+
+/* Double the intern table, rehashing every string */
+static bool intern_grow()
+{
+    size_t n = nslots ? 2 * nslots : 1024;
+    size_t *table = malloc(n * sizeof(*table));
+    char **s = realloc(strs, n / 2 * sizeof(*strs));
+    if (!table || !s) {
+        free(table);
+        if (s)
+            strs = s;
+        return false;
+    }
+
+    strs = s;
+    memset(table, 0xff, n * sizeof(*table));
+    for (size_t i = 0; i < nstrs; i++) {
+        size_t j = str_fnv(strs[i]) & (n - 1);
+        while (table[j] != SIZE_MAX)
+            j = (j + 1) & (n - 1);
+        table[j] = i;
+    }
+    free(slots);
+    slots = table;
+    nslots = n;
+
+    return true;
+}
+
+bool bt_record_open(const char *fname)
+{
+    if (out)
+        bt_record_close();
+
+    out = fopen(fname, "wb");
+    if (!out)
+        return false;
+
+    setvbuf(out, NULL, _IOFBF, BT_IOBUF_SIZE);
+    out_failed = fwrite(bt_magic, sizeof(bt_magic), 1, out) != 1;
+
+    return true;
+}
+
+bool bt_record_close()
+{
+    if (!out)
+        return true;
+
+    bool ok = !out_failed && !ferror(out);
+    ok = !fclose(out) && ok;
+    out = NULL;
+
+    for (size_t i = 0; i < nstrs; i++)
+        free(strs[i]);
+    free(strs);
+    free(slots);
+    strs = NULL;
+    slots = NULL;
+    nstrs = nslots = 0;
+
+    return ok;
+}
+
+bool bt_recording()
+{
+    return out != NULL;
+}
+
+void bt_put_op(bt_op_t op)
+{
+    if (out)
+        putc(op, out);
+}
+
+void bt_put_int(int64_t v)
+{
+    if (out)
+        put_varint(((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+void bt_put_str(const char *s)
+{
+    if (!out)
+        return;
+
+    if (2 * (nstrs + 1) > nslots && !intern_grow()) {
+        out_failed = true;
+        return;
+    }
+
+    size_t j = str_fnv(s) & (nslots - 1);
+    for (; slots[j] != SIZE_MAX; j = (j + 1) & (nslots - 1)) {
+        if (!strcmp(strs[slots[j]], s)) {
+            put_varint(slots[j]);
+            return;
+        }
+    }
+
+    size_t len = strlen(s);
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        out_failed = true;
+        return;
+    }
+    memcpy(copy, s, len + 1);
+    slots[j] = nstrs;
+    strs[nstrs] = copy;
+
+    put_varint(nstrs++);
+    put_varint(len);
+    fwrite(s, 1, len + 1, out);
+}
+
+bool bt_load(bt_reader_t *r, const char *fname)
+{
+    memset(r, 0, sizeof(*r));
+
+    FILE *in = fopen(fname, "rb");
+    if (!in)
+        return false;
+
+    long size = -1;
+    if (!fseek(in, 0, SEEK_END))
+        size = ftell(in);
+    if (size < (long) sizeof(bt_magic) || fseek(in, 0, SEEK_SET)) {
+        fclose(in);
+        return false;
+    }
+
+    r->buf = malloc(size);
+    bool ok = r->buf && fread(r->buf, 1, size, in) == (size_t) size &&
+              !memcmp(r->buf, bt_magic, sizeof(bt_magic));
+    fclose(in);
+    if (!ok) {
+        bt_unload(r);
+        return false;
+    }
+
+    r->pos = r->buf + sizeof(bt_magic);
+    r->end = r->buf + size;
+
+    return true;
+}
+
+void bt_unload(bt_reader_t *r)
+{
+    free(r->buf);
+    free(r->strs);
+    memset(r, 0, sizeof(*r));
+}
+
+static uint64_t get_varint(bt_reader_t *r)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->pos == r->end)
+            break;
+        uint8_t b = *r->pos++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+
+    r->bad = true;
+    return 0;
+}
+
+int bt_get_op(bt_reader_t *r)
+{
+    if (r->bad || r->pos == r->end)
+        return -1;
+
+    int op = *r->pos++;
+    if (op >= BT_NUM_OPS) {
+        r->bad = true;
+        return -1;
+    }
+
+    return op;
+}
+
+int64_t bt_get_int(bt_reader_t *r)
+{
+    uint64_t v = get_varint(r);
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+const char *bt_get_str(bt_reader_t *r)
+{
+    uint64_t i = get_varint(r);
+    if (r->bad)
+        return NULL;
+    if (i < r->nstrs)
+        return r->strs[i];
+    if (i > r->nstrs) {
+        r->bad = true;
+        return NULL;
+    }
+
+    /* A new string follows, with its terminator */
+    uint64_t len = get_varint(r);
+    if (r->bad || len >= (uint64_t) (r->end - r->pos) || r->pos[len]) {
+        r->bad = true;
+        return NULL;
+    }
+
+    if (r->nstrs == r->cap) {
+        size_t cap = r->cap ? 2 * r->cap : 1024;
+        const char **s = realloc(r->strs, cap * sizeof(*s));
+        if (!s) {
+            r->bad = true;
+            return NULL;
+        }
+        r->strs = s;
+        r->cap = cap;
+    }
+
+    const char *s = (const char *) r->pos;
+    r->pos += len + 1;
+    r->strs[r->nstrs++] = s;
+
+    return s;
+}
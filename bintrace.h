@@ -0,0 +1,87 @@
+#ifndef LAB0_BINTRACE_H
+#define LAB0_BINTRACE_H
+
+/*
+ * Binary traces of queue operations.
+ *
+ * A binary trace starts with the 4-byte magic "QTB1" and is followed by
+ * records, each an opcode byte and the arguments of that opcode. Integers
+ * are zigzag-encoded LEB128 varints. A string is a varint index into the
+ * table of strings seen so far; an index equal to the size of the table
+ * introduces a new string, whose varint length, bytes and terminating null
+ * follow, so every distinct string is stored once and can be used in place.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opcodes and their arguments */
+typedef enum {
+    BT_NEW,          /* ring */
+    BT_FREE,         /* */
+    BT_SELECT,       /* id */
+    BT_ALLOC,        /* mode */
+    BT_INSERT,       /* tail, n, cnt, cnt strings */
+    BT_REMOVE,       /* tail, bufsize, or -1 to remove by reference */
+    BT_REMOVE_RANGE, /* k */
+    BT_REVERSE,      /* */
+    BT_SORT,         /* threads */
+    BT_LINUX_SORT,   /* */
+    BT_SIZE,         /* n */
+    BT_DM,           /* */
+    BT_DEDUP,        /* hash */
+    BT_SWAP,         /* */
+    BT_SHUFFLE,      /* window */
+    BT_MERGE,        /* */
+    BT_COMPACT,      /* */
+    BT_NUM_OPS,
+} bt_op_t;
+
+/*
+ * Start recording to file fname, replacing it.
+ * Return true if successful.
+ */
+bool bt_record_open(const char *fname);
+
+/* Finish recording. Return true if every record was written */
+bool bt_record_close();
+
+/* Return true if recording */
+bool bt_recording();
+
+/* Append the opcode of a new record, then its arguments */
+void bt_put_op(bt_op_t op);
+void bt_put_int(int64_t v);
+void bt_put_str(const char *s);
+
+/* Binary trace loaded for replay */
+typedef struct {
+    uint8_t *buf;
+    const uint8_t *pos, *end;
+    /* Strings introduced so far, pointing into buf */
+    const char **strs;
+    size_t nstrs, cap;
+    /* Set once any record turns out to be malformed */
+    bool bad;
+} bt_reader_t;
+
+/*
+ * Load the binary trace in file fname.
+ * Return true if successful.
+ */
+bool bt_load(bt_reader_t *r, const char *fname);
+
+/* Release a loaded trace */
+void bt_unload(bt_reader_t *r);
+
+/*
+ * Read the opcode of the next record, then its arguments.
+ * bt_get_op returns -1 at the end of the trace or if it is malformed, and
+ * the others return 0 or NULL once it is malformed.
+ */
+int bt_get_op(bt_reader_t *r);
+int64_t bt_get_int(bt_reader_t *r);
+const char *bt_get_str(bt_reader_t *r);
+
+#endif /* LAB0_BINTRACE_H */
@@ -3,9 +3,11 @@
 #include "console.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,10 +15,22 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#endif
 
+#include "dudect/cpucycles.h"
 #include "report.h"
 
+/* Console needs the regular malloc/free, and the harness section timing */
+#define INTERNAL 1
+#include "harness.h"
+
 /* Some global values */
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
@@ -34,9 +48,12 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Input is read in large blocks and split into lines with memchr, so that
+ * traces of millions of commands cost few system calls.
  */
 
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 65536
+#define MAXLINE 8192
 typedef struct RIO_ELE rio_t, *rio_ptr;
 
 struct RIO_ELE {
@@ -48,7 +65,18 @@ struct RIO_ELE {
 };
 
 static rio_ptr buf_stack;
-static char linebuf[RIO_BUFSIZE];
+static char linebuf[MAXLINE];
+
+/*
+ * Commands are also chained in a hash table by name, so that dispatching a
+ * command does not walk the alphabetical list.
+ */
+#define CMD_HASH_SIZE 128
+static cmd_ptr cmd_table[CMD_HASH_SIZE];
+
+/* Argument vector of the command being interpreted, reused for every line */
+static char **arg_buf = NULL;
+static int arg_cap = 0;
 
 /* Maximum file descriptor */
 static int fd_max = 0;
@@ -58,6 +86,9 @@ static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
 
+/* File to write latency statistics to when quitting, see set_stats_file() */
+static char *stats_file = NULL;
+
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
@@ -76,6 +107,15 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of a command name */
+static unsigned int cmd_hash(const char *name)
+{
+    unsigned int h = 2166136261u;
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h % CMD_HASH_SIZE;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -91,7 +131,13 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->operation = operation;
     ele->documentation = documentation;
     ele->next = next_cmd;
+    ele->latency = NULL;
+    ele->op_latency = NULL;
     *last_loc = ele;
+
+    unsigned int h = cmd_hash(name);
+    ele->hash_next = cmd_table[h];
+    cmd_table[h] = ele;
 }
 
 /* Add a new parameter */
@@ -116,50 +162,43 @@ void add_param(char *name,
     *last_loc = ele;
 }
 
-/* Parse a string into a command line */
+/*
+ * Split a command line into arguments in place.
+ * White space in line is overwritten with null characters, and the returned
+ * vector, which points into line, stays valid until the next call.
+ */
 static char **parse_args(char *line, int *argcp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
+    char *src = line;
+
+    for (;;) {
+        while (isspace((unsigned char) *src))
+            src++;
+        if (!*src)
+            break;
+
+        if (argc == arg_cap) {
+            int cap = arg_cap ? 2 * arg_cap : 16;
+            char **buf = malloc_or_fail(cap * sizeof(char *), "parse_args");
+            if (arg_buf) {
+                memcpy(buf, arg_buf, arg_cap * sizeof(char *));
+                free_array(arg_buf, arg_cap, sizeof(char *));
             }
-            *dst++ = c;
+            arg_buf = buf;
+            arg_cap = cap;
         }
-    }
+        arg_buf[argc++] = src;
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        while (*src && !isspace((unsigned char) *src))
+            src++;
+        if (!*src)
+            break;
+        *src++ = '\0';
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return arg_buf;
 }
 
 static void record_error()
@@ -171,18 +210,42 @@ static void record_error()
     }
 }
 
+/*
+ * Add one execution of command c, which took cycles in total and op_cycles
+ * in exception sections, to its histograms
+ */
+static void record_latency(cmd_ptr c, uint64_t cycles, uint64_t op_cycles)
+{
+    if (!c->latency) {
+        c->latency = calloc_or_fail(1, sizeof(lat_hist_t), "record_latency");
+        c->op_latency =
+            calloc_or_fail(1, sizeof(lat_hist_t), "record_latency");
+    }
+
+    lat_record(c->latency, cycles);
+    /* Only commands running queue code inside a section have an op time */
+    if (op_cycles)
+        lat_record(c->op_latency, op_cycles);
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = cmd_table[cmd_hash(argv[0])];
     bool ok = true;
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
+        next_cmd = next_cmd->hash_next;
     if (next_cmd) {
+        uint64_t op_cycles = exception_cycles();
+        int64_t start = cpucycles();
         ok = next_cmd->operation(argc, argv);
+        /* Unless the command was quit, which freed every command */
+        if (cmd_list)
+            record_latency(next_cmd, cpucycles() - start,
+                           exception_cycles() - op_cycles);
         if (!ok)
             record_error();
     } else {
@@ -194,7 +257,10 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
+/*
+ * Execute a command from a command line.
+ * The line is tokenized in place, so its content is lost.
+ */
 static bool interpret_cmd(char *cmdline)
 {
     if (quit_flag)
@@ -205,12 +271,7 @@ static bool interpret_cmd(char *cmdline)
 #endif
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    return interpret_cmda(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -228,16 +289,82 @@ void set_echo(bool on)
     echo = on ? 1 : 0;
 }
 
+/* Write command latency statistics to file_name when quitting */
+void set_stats_file(char *file_name)
+{
+    stats_file = file_name;
+}
+
+/* Write the members of a JSON object describing h */
+static void write_hist_json(FILE *f, const lat_hist_t *h)
+{
+    fprintf(f,
+            "\"count\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %" PRIu64
+            ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+            ", \"max\": %" PRIu64,
+            h->total, lat_mean(h), lat_quantile(h, 500), lat_quantile(h, 990),
+            lat_quantile(h, 999), h->max);
+}
+
+/*
+ * Write latency statistics of every executed command to file_name, as a JSON
+ * object mapping command names to their statistics in cycles, with those of
+ * their time in queue code under "queue_per_command"
+ */
+static bool write_stats(char *file_name)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "{\"commands\": {");
+    bool first = true;
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        if (!c->latency)
+            continue;
+        fprintf(f, "%s\n  \"%s\": {", first ? "" : ",", c->name);
+        first = false;
+        write_hist_json(f, c->latency);
+        if (c->op_latency->total) {
+            fprintf(f, ", \"queue_per_command\": {");
+            write_hist_json(f, c->op_latency);
+            fprintf(f, "}");
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n}}\n");
+
+    return !fclose(f);
+}
+
+static void free_latency(cmd_ptr c)
+{
+    if (c->latency) {
+        free_block(c->latency, sizeof(lat_hist_t));
+        free_block(c->op_latency, sizeof(lat_hist_t));
+        c->latency = c->op_latency = NULL;
+    }
+}
+
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
     cmd_ptr c = cmd_list;
     bool ok = true;
+
+    if (stats_file && !write_stats(stats_file)) {
+        report(1, "Couldn't write statistics file '%s'", stats_file);
+        ok = false;
+    }
+
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        free_latency(ele);
         free_block(ele, sizeof(cmd_ele));
     }
+    cmd_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
 
     param_ptr p = param_list;
     while (p) {
@@ -245,6 +372,7 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
+    param_list = NULL;
 
     while (buf_stack)
         pop_file();
@@ -253,6 +381,13 @@ static bool do_quit(int argc, char *argv[])
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    /* Only now, since argv may be the argument buffer itself */
+    if (arg_buf) {
+        free_array(arg_buf, arg_cap, sizeof(char *));
+        arg_buf = NULL;
+        arg_cap = 0;
+    }
+
     quit_flag = true;
     return ok;
 }
@@ -397,10 +532,52 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static void report_hist(const char *name, const lat_hist_t *h)
+{
+    report(1,
+           "%-12s %10" PRIu64 " %12.1f %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+           " %12" PRIu64,
+           name, h->total, lat_mean(h), lat_quantile(h, 500),
+           lat_quantile(h, 990), lat_quantile(h, 999), h->max);
+}
+
+static void report_stats(bool queue)
+{
+    report(1, "%-12s %10s %12s %10s %10s %10s %12s", "Command", "count",
+           "mean", "p50", "p99", "p999", "max");
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        lat_hist_t *h = queue ? c->op_latency : c->latency;
+        if (h && h->total)
+            report_hist(c->name, h);
+    }
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        for (cmd_ptr c = cmd_list; c; c = c->next)
+            free_latency(c);
+        return true;
+    }
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments, or 'reset'", argv[0]);
+        return false;
+    }
+
+    report(1, "Latency of commands (cycles):");
+    report_stats(false);
+    report(1, "Time in queue code per command (cycles):");
+    report_stats(true);
+
+    return true;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
     param_list = NULL;
     err_cnt = 0;
     quit_flag = false;
@@ -411,6 +588,9 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(stats,
+                " [reset]        | Show latency statistics of commands, or "
+                "clear them");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
@@ -468,14 +648,12 @@ static void init_in()
  */
 static char *readline()
 {
-    int cnt;
-    char c;
-    char *lptr = linebuf;
+    size_t cnt = 0;
 
     if (!buf_stack)
         return NULL;
 
-    for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    for (;;) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
             buf_stack->cnt = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
@@ -486,31 +664,36 @@ static char *readline()
                 if (cnt > 0) {
                     /* Last line of file did not terminate with newline. */
                     /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
+                    break;
                 }
                 return NULL;
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->cnt--;
-        if (c == '\n')
+        /* Have text in buffer, copy it up to the newline if there is one */
+        size_t avail = buf_stack->cnt;
+        char *nl = memchr(buf_stack->bufptr, '\n', avail);
+        size_t take = nl ? (size_t) (nl - buf_stack->bufptr) + 1 : avail;
+        if (take > MAXLINE - 2 - cnt) {
+            /* Hit buffer limit.  Artificially terminate line */
+            take = MAXLINE - 2 - cnt;
+            nl = NULL;
+        }
+        memcpy(linebuf + cnt, buf_stack->bufptr, take);
+        buf_stack->bufptr += take;
+        buf_stack->cnt -= take;
+        cnt += take;
+        if (nl) {
+            /* The newline is already copied */
+            cnt--;
+            break;
+        }
+        if (cnt == MAXLINE - 2)
             break;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
-    }
-    *lptr++ = '\0';
+    linebuf[cnt++] = '\n';
+    linebuf[cnt] = '\0';
 
     if (echo) {
         report_noreturn(1, prompt);
@@ -547,6 +730,24 @@ int cmd_select(int nfds,
     if (cmd_done())
         return 0;
 
+    /*
+     * A command already in the input buffer can run without waiting on
+     * select, which would cost a system call per line of a long trace.
+     * The caller's sets are cleared, as a select finding nothing ready would.
+     */
+    if (!block_flag && has_infile && buf_stack->cnt > 0) {
+        if (readfds)
+            FD_ZERO(readfds);
+        if (writefds)
+            FD_ZERO(writefds);
+        if (exceptfds)
+            FD_ZERO(exceptfds);
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 0;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -647,9 +848,10 @@ bool run_console(char *infile_name)
         linenoiseHistoryLoad(HISTORY_FILE);
         char *cmdline;
         while ((cmdline = linenoise(prompt)) != NULL) {
-            interpret_cmd(cmdline);
+            /* Record the line before interpreting splits it up */
             linenoiseHistoryAdd(cmdline);       /* Add to the history. */
             linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
+            interpret_cmd(cmdline);
             linenoiseFree(cmdline);
         }
     } else {
@@ -659,3 +861,378 @@ bool run_console(char *infile_name)
 
     return err_cnt == 0;
 }
+
+/*
+ * Network mode.
+ *
+ * Clients connect over TCP and stream command lines.  Whenever a client is
+ * readable, every complete line it has sent is run as one batch.  The output
+ * of each command, followed by a line saying OK or FAIL, is queued for the
+ * client and written back as fast as the socket takes it, so that clients
+ * can pipeline commands without waiting for each response.  A client sending
+ * quit is disconnected once its output is written, and the others go on.
+ */
+
+static session_save_function session_save = NULL;
+static session_restore_function session_restore = NULL;
+
+void set_session_hooks(session_save_function save,
+                       session_restore_function restore)
+{
+    session_save = save;
+    session_restore = restore;
+}
+
+#ifdef __linux__
+
+/* Stop reading from a client while this much of its output is unsent */
+#define CLIENT_OUT_LIMIT (1 << 20)
+
+/* Events handled per call to epoll_wait */
+#define SERVER_EVENTS 64
+
+typedef struct client client_t;
+struct client {
+    int fd;
+    int session;     /* Saved by session_save between batches */
+    bool closing;    /* Sent quit or end of file, disconnect once written */
+    uint32_t events; /* Events the client is registered for */
+    size_t in_len;   /* Bytes of an unfinished line in in */
+    char *out;       /* Output not sent yet starts at out + out_sent */
+    size_t out_len, out_sent, out_cap;
+    client_t *next;
+    char in[MAXLINE];
+};
+
+static volatile sig_atomic_t server_stop = 0;
+
+static void server_interrupt(int sig)
+{
+    server_stop = 1;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* Queue len bytes of output for client c */
+static void client_queue(client_t *c, const char *buf, size_t len)
+{
+    if (c->out_sent) {
+        c->out_len -= c->out_sent;
+        memmove(c->out, c->out + c->out_sent, c->out_len);
+        c->out_sent = 0;
+    }
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + len)
+            cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (!out) {
+            report_event(MSG_FATAL, "Could not buffer output for client");
+            return;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, buf, len);
+    c->out_len += len;
+}
+
+/* Send as much queued output as the socket takes. Return false on error */
+static bool client_flush(client_t *c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return true;
+}
+
+/* Register c for reading unless it has too much output pending, and writing */
+static bool client_watch(int epfd, client_t *c)
+{
+    size_t pending = c->out_len - c->out_sent;
+    uint32_t events = pending ? EPOLLOUT : 0;
+    if (!c->closing && pending < CLIENT_OUT_LIMIT)
+        events |= EPOLLIN;
+    if (events == c->events)
+        return true;
+
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    c->events = events;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0;
+}
+
+/*
+ * Run the line of len bytes at line, writing the output to out.
+ * Return false if the line is quit, or ran a quit in a sourced file, which
+ * leaves nothing to interpret later lines with.
+ */
+static bool client_command(FILE *out, const char *line, size_t len)
+{
+    memcpy(linebuf, line, len);
+    linebuf[len++] = '\n';
+    linebuf[len] = '\0';
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, linebuf);
+    }
+
+    int argc;
+    char **argv = parse_args(linebuf, &argc);
+    if (argc && !strcmp(argv[0], "quit")) {
+        fputs("OK\n", out);
+        return false;
+    }
+
+    /* A client's errors are its own, and must not stop the server */
+    int errors = err_cnt;
+    bool ok = interpret_cmda(argc, argv);
+    /* Commands may source files, which are read to the end at once */
+    while (buf_stack && !quit_flag) {
+        char *cmdline = readline();
+        if (cmdline)
+            ok = interpret_cmd(cmdline) && ok;
+    }
+    err_cnt = errors;
+
+    fputs(ok ? "OK\n" : "FAIL\n", out);
+    return !quit_flag;
+}
+
+/*
+ * Run the complete lines c has sent as one batch, and the unfinished one too
+ * if c is closing. Return the number of commands run.
+ */
+static size_t client_batch(client_t *c)
+{
+    char *start = c->in, *end = c->in + c->in_len, *nl;
+    bool full = c->in_len == MAXLINE - 2;
+    if (!memchr(start, '\n', c->in_len) && !full && !(c->closing && c->in_len))
+        return 0;
+
+    char *buf = NULL;
+    size_t len = 0, cnt = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (!out) {
+        report_event(MSG_FATAL, "Could not capture output for client");
+        return 0;
+    }
+    set_report_file(out);
+    if (session_restore)
+        session_restore(c->session);
+
+    bool quit = false;
+    while (!quit && (nl = memchr(start, '\n', end - start))) {
+        cnt++;
+        quit = !client_command(out, start, nl - start);
+        start = nl + 1;
+    }
+    /*
+     * The last line may lack a newline, and one filling the buffer is cut
+     * short, as readline() does
+     */
+    if (!quit && start < end && (c->closing || (full && start == c->in))) {
+        cnt++;
+        quit = !client_command(out, start, end - start);
+        start = end;
+    }
+    if (quit) {
+        c->closing = true;
+        start = end;
+    }
+    c->in_len = end - start;
+    memmove(c->in, start, c->in_len);
+
+    if (session_save)
+        c->session = session_save();
+    set_report_file(NULL);
+    fclose(out);
+    client_queue(c, buf, len);
+    free(buf);
+    return cnt;
+}
+
+/* Read from c. Return false if the connection failed */
+static bool client_read(client_t *c)
+{
+    ssize_t n = recv(c->fd, c->in + c->in_len, MAXLINE - 2 - c->in_len, 0);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (n == 0)
+        c->closing = true;
+    c->in_len += n;
+    return true;
+}
+
+static client_t *client_accept(int epfd, int listenfd, int session)
+{
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0)
+        return NULL;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client_t *c = calloc(1, sizeof(client_t));
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    if (!c || !set_nonblocking(fd) || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        report(1, "ERROR: Could not accept client");
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->session = session;
+    c->events = EPOLLIN;
+    return c;
+}
+
+static void client_close(client_t *c)
+{
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+static int server_listen(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, SOMAXCONN) || !set_nonblocking(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool run_server(int port)
+{
+    /* A quit run before, e.g. from the startup file, freed every command */
+    if (quit_flag) {
+        report(1, "Not serving clients after quit");
+        return true;
+    }
+
+    int listenfd = server_listen(port);
+    if (listenfd < 0) {
+        report(1, "ERROR: Could not listen on port %d: %s", port,
+               strerror(errno));
+        return false;
+    }
+    int epfd = epoll_create1(0);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev)) {
+        report(1, "ERROR: Could not wait for clients: %s", strerror(errno));
+        close(listenfd);
+        if (epfd >= 0)
+            close(epfd);
+        return false;
+    }
+
+    struct sigaction sa = {.sa_handler = server_interrupt}, old_int, old_term;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    /* Clients start out with the state left by the commands run before */
+    int session = session_save ? session_save() : 0;
+    client_t *clients = NULL;
+    size_t nclients = 0, ncmds = 0;
+    double busy = 0;
+    report(1, "Serving commands on port %d", port);
+
+    /* A quit in a file sourced by a client tears down every command */
+    struct epoll_event events[SERVER_EVENTS];
+    while (!server_stop && !quit_flag) {
+        int n = epoll_wait(epfd, events, SERVER_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            report(1, "ERROR: Waiting for clients failed: %s",
+                   strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n && !quit_flag; i++) {
+            client_t *c = events[i].data.ptr;
+            if (!c) {
+                while ((c = client_accept(epfd, listenfd, session))) {
+                    c->next = clients;
+                    clients = c;
+                    nclients++;
+                }
+                continue;
+            }
+
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ok = client_read(c);
+                double start = now();
+                ncmds += client_batch(c);
+                busy += now() - start;
+            }
+            ok = ok && client_flush(c);
+            if (ok && c->closing && c->out_len == c->out_sent)
+                ok = false;
+            if (ok && client_watch(epfd, c))
+                continue;
+
+            client_t **p = &clients;
+            while (*p != c)
+                p = &(*p)->next;
+            *p = c->next;
+            client_close(c);
+        }
+    }
+
+    if (quit_flag)
+        report(1, "Stopped serving clients after quit");
+    while (clients) {
+        client_t *next = clients->next;
+        client_close(clients);
+        clients = next;
+    }
+    close(epfd);
+    close(listenfd);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+
+    report(1, "Served %zu commands to %zu clients, %.0f per second while busy",
+           ncmds, nclients, busy > 0 ? ncmds / busy : 0);
+    return true;
+}
+
+#else
+
+bool run_server(int port)
+{
+    report(1, "ERROR: Network mode needs epoll, which is only on Linux");
+    return false;
+}
+
+#endif
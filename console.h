@@ -2,6 +2,7 @@
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
 #include <sys/select.h>
+#include "latency.h"
 #include "linenoise.h"
 #define HISTORY_FILE ".cmd_history"
 
@@ -15,13 +16,24 @@ typedef bool (*cmd_function)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/*
+ * Organized as linked list in alphabetical order, and chained in a hash
+ * table by name for dispatch
+ */
 typedef struct CELE cmd_ele, *cmd_ptr;
 struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
     cmd_ptr next;
+    cmd_ptr hash_next;
+    /*
+     * Cycles taken by each execution, and in total by the exception sections
+     * within it, which is its time in queue code: one sample per execution,
+     * however many queue calls it made. Allocated on first execution.
+     */
+    lat_hist_t *latency;
+    lat_hist_t *op_latency;
 };
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -60,6 +72,9 @@ void add_quit_helper(cmd_function qf);
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/* Write command latency statistics as JSON to file_name when quitting */
+void set_stats_file(char *file_name);
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
@@ -79,6 +94,23 @@ int cmd_select(int nfds,
  */
 bool run_console(char *infile_name);
 
+/*
+ * State that each network client keeps apart from the others, such as the
+ * selected queue, which save returns as an integer and restore brings back
+ */
+typedef int (*session_save_function)(void);
+typedef void (*session_restore_function)(int state);
+void set_session_hooks(session_save_function save,
+                       session_restore_function restore);
+
+/*
+ * Serve commands to TCP clients connecting to port on the loopback interface,
+ * until interrupted by SIGINT or SIGTERM, or until a file sourced by a client
+ * quits. Nothing is served once a command file run before has quit.
+ * Return true if the server could run, or was not needed.
+ */
+bool run_server(int port);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
@@ -10,7 +10,7 @@
 #include "queue.h"
 #include "random.h"
 
-#define N_MEASURE 150
+#define N_MEASURE 500
 
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
@@ -28,13 +28,6 @@ static struct list_head *l = NULL;
 static char random_string[N_MEASURE][8];
 static int random_string_iter = 0;
 
-enum {
-    test_insert_head,
-    test_insert_tail,
-    test_remove_head,
-    test_remove_tail,
-};
-
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
 {
@@ -47,6 +40,15 @@ char *get_random_string(void)
     return random_string[random_string_iter];
 }
 
+static void prepare_strings(void)
+{
+    for (size_t i = 0; i < N_MEASURE; ++i) {
+        /* Generate random string */
+        randombytes((uint8_t *) random_string[i], 7);
+        random_string[i][7] = 0;
+    }
+}
+
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, n_measure * chunk_size);
@@ -56,86 +58,129 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
             memset(input_data + (size_t) i * chunk_size, 0, chunk_size);
     }
 
-    for (size_t i = 0; i < N_MEASURE; ++i) {
-        /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
-        random_string[i][7] = 0;
+    prepare_strings();
+}
+
+/*
+ * Prepare inputs building queues of size elements for class 0, and of twice
+ * as many for class 1. size must stay below 5000.
+ */
+void prepare_sized_inputs(uint8_t *input_data, uint8_t *classes, int size)
+{
+    assert(size > 0 && size < 5000);
+    memset(input_data, 0, n_measure * chunk_size);
+    for (size_t i = 0; i < n_measure; i++) {
+        classes[i] = randombit();
+        *(uint16_t *) (input_data + i * chunk_size) = size << classes[i];
     }
+
+    prepare_strings();
+}
+
+/* State carried from one step of a measured operation to the next */
+static char *dut_string;
+static element_t *dut_element;
+
+static void pick_string(void)
+{
+    dut_string = get_random_string();
+}
+
+static void release_element(void)
+{
+    if (dut_element)
+        q_release_element(dut_element);
+    dut_element = NULL;
+}
+
+static void run_insert_head(void)
+{
+    dut_insert_head(dut_string, 1);
+}
+
+static void run_insert_tail(void)
+{
+    dut_insert_tail(dut_string, 1);
+}
+
+static void run_remove_head(void)
+{
+    dut_element = q_remove_head(l, NULL, 0);
+}
+
+static void run_remove_tail(void)
+{
+    dut_element = q_remove_tail(l, NULL, 0);
+}
+
+static void run_size(void)
+{
+    dut_size(1);
+}
+
+static void run_reverse(void)
+{
+    q_reverse(l);
+}
+
+static void run_swap(void)
+{
+    q_swap(l);
 }
 
+static void run_delete_mid(void)
+{
+    q_delete_mid(l);
+}
+
+static void run_sort(void)
+{
+    q_sort(l);
+}
+
+const char *const dut_growth_names[] = {
+    [growth_constant] = "constant",
+    [growth_linear] = "linear",
+    [growth_linearithmic] = "linearithmic",
+};
+
+/* q_reverse only flips the direction of a list */
+const dut_op_t dut_ops[] = {
+    [test_insert_head] = {"insert_head", growth_constant, pick_string,
+                          run_insert_head, NULL},
+    [test_insert_tail] = {"insert_tail", growth_constant, pick_string,
+                          run_insert_tail, NULL},
+    [test_remove_head] = {"remove_head", growth_constant, NULL,
+                          run_remove_head, release_element},
+    [test_remove_tail] = {"remove_tail", growth_constant, NULL,
+                          run_remove_tail, release_element},
+    [test_size] = {"size", growth_constant, NULL, run_size, NULL},
+    [test_reverse] = {"reverse", growth_constant, NULL, run_reverse, NULL},
+    [test_swap] = {"swap", growth_linear, NULL, run_swap, NULL},
+    [test_delete_mid] = {"delete_mid", growth_linear, NULL, run_delete_mid,
+                         NULL},
+    [test_sort] = {"sort", growth_linearithmic, NULL, run_sort, NULL},
+};
+
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
-    assert(mode == test_insert_head || mode == test_insert_tail ||
-           mode == test_remove_head || mode == test_remove_tail);
-
-    switch (mode) {
-    case test_insert_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
-        break;
-    case test_insert_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
-        break;
-    case test_remove_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
-        }
-        break;
-    case test_remove_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
-        }
-        break;
-    default:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
+    assert(mode >= 0 && mode < dut_tests);
+    const dut_op_t *op = &dut_ops[mode];
+
+    for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        if (op->prepare)
+            op->prepare();
+        dut_new();
+        dut_insert_head(get_random_string(),
+                        *(uint16_t *) (input_data + i * chunk_size) % 10000);
+        before_ticks[i] = cpucycles();
+        op->run();
+        after_ticks[i] = cpucycles();
+        if (op->finish)
+            op->finish();
+        dut_free();
     }
 }
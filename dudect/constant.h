@@ -26,8 +26,52 @@
 
 #define dut_free() ((void) (q_free(l)))
 
+/*
+ * Queue operations that can be measured, indexing dut_ops. The growth of
+ * each entry says how its time is expected to grow with the queue size.
+ */
+enum {
+    test_insert_head,
+    test_insert_tail,
+    test_remove_head,
+    test_remove_tail,
+    test_size,
+    test_reverse,
+    test_swap,
+    test_delete_mid,
+    test_sort,
+    dut_tests,
+};
+
+/* How the time of an operation grows with the size n of the queue */
+typedef enum {
+    growth_constant,
+    growth_linear,
+    growth_linearithmic, /* n log n */
+    dut_growths,
+} dut_growth_t;
+
+/* Names of the growth classes, as in "linear time" */
+extern const char *const dut_growth_names[dut_growths];
+
+/*
+ * Each sample times one call of run on a fresh queue, whose size depends on
+ * the class of the sample. prepare is called before the queue is built and
+ * finish after the call, both untimed, and either may be NULL.
+ */
+typedef struct {
+    const char *name;
+    dut_growth_t growth;
+    void (*prepare)(void);
+    void (*run)(void);
+    void (*finish)(void);
+} dut_op_t;
+
+extern const dut_op_t dut_ops[dut_tests];
+
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
+void prepare_sized_inputs(uint8_t *input_data, uint8_t *classes, int size);
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
@@ -22,10 +22,35 @@
  *    probably redundant since we're doing as well a t-test on cropped
  *    measurements (non-linear transform)
  *
- *  - as long as any of the different test fails, the code will be deemed
- *    variable time.
+ *  - the verdict rests on the most cropped test, which keeps the fastest
+ *    90% of the measurements, so that outliers cannot pull its t value
+ *    down. It has a threshold of its own: the classes of measure() start
+ *    from queues of different sizes, and building a large queue leaves the
+ *    caches colder, so even q_size takes about twice as long on one class.
+ *    That gives t values of 20 to 50 on operations that run in constant
+ *    time, against 75 to 110 on ones that walk the queue. The same effect
+ *    puts the uncropped t anywhere from 1 to 50 on constant time operations,
+ *    so the uncropped test only fails a leak as large as
+ *    t_threshold_bananas. The other cropped tests and the second order test
+ *    are informational only and are printed as such.
+ *
+ *  - the tests are sequential: after every batch of measurements we check
+ *    whether the outcome is already settled. A leak as large as
+ *    t_threshold_bananas fails the whole test at once, and once the
+ *    normalized statistic tau predicts a cropped t value beyond
+ *    t_threshold_predicted at enough_measure measurements for several
+ *    batches in a row, the round fails and the next one starts. A round
+ *    only passes with all of its enough_measure measurements.
+ *
+ *  - measuring runs on a single CPU, isolated from the scheduler if the
+ *    kernel was booted with isolcpus, so that migrations between cores do
+ *    not add to the cycle counts.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
 #include "fixture.h"
 #include <assert.h>
 #include <math.h>
@@ -41,17 +66,54 @@
 #define enough_measure 10000
 #define test_tries 10
 
+/* Fewest measurements a test needs before its t value is trusted */
+#define min_measure (enough_measure / 4)
+
+/* Consecutive batches that must predict a failure before stopping early */
+#define stable_batches 3
+
+/* Batches before giving up on a round, if too many measurements drop out */
+#define max_batches (4 * enough_measure / (n_measure - drop_size * 2) + 1)
+
+/* Cropped tests, each keeping the measurements below one percentile */
+#define number_percentiles 10
+
+/* Uncropped test, cropped tests, then the second order test */
+#define number_tests (1 + number_percentiles + 1)
+
 extern const int drop_size;
 extern const size_t chunk_size;
 extern const size_t n_measure;
+
+/* Buffers of one batch, allocated once and reused by every batch */
+static struct {
+    int64_t *before_ticks;
+    int64_t *after_ticks;
+    int64_t *exec_times;
+    int64_t *sorted_times;
+    uint8_t *classes;
+    uint8_t *input_data;
+} batch;
+
 static t_ctx *t;
+static int64_t percentiles[number_percentiles];
+static bool have_percentiles;
+/* Batches in a row predicting a failure */
+static int stable;
 
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
-    t_threshold_moderate = 10, /* Test failed */
+    t_threshold_predicted = 100, /* Test would fail by far with more samples */
+    t_threshold_cropped = 60, /* Cropped test failed */
 };
 
+/*
+ * Outcome of a round so far. A round that FAILED is retried, but one that
+ * LEAKED is beyond the noise that retries are meant to ride out.
+ */
+typedef enum { UNDECIDED, PASSED, FAILED, LEAKED } verdict_t;
+
 static void __attribute__((noreturn)) die(void)
 {
     exit(111);
@@ -65,6 +127,37 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
+static int cmp_ticks(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Set the cropping thresholds from the first batch of a round. They only
+ * crop the slow tail: threshold i keeps 1 - 0.1 * 0.01^(i / (P - 1)) of the
+ * measurements, from 90% up to 99.9%.
+ */
+static void prepare_percentiles(const int64_t *exec_times)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < n_measure; i++) {
+        if (exec_times[i] > 0)
+            batch.sorted_times[n++] = exec_times[i];
+    }
+    if (!n)
+        return;
+
+    qsort(batch.sorted_times, n, sizeof(int64_t), cmp_ticks);
+    for (size_t i = 0; i < number_percentiles; i++) {
+        double which =
+            1 - 0.1 * pow(0.01, (double) i / (number_percentiles - 1));
+        size_t pos = (size_t) (which * n);
+        percentiles[i] = batch.sorted_times[pos < n ? pos : n - 1];
+    }
+    have_percentiles = true;
+}
+
 static void update_statistics(const int64_t *exec_times, uint8_t *classes)
 {
     for (size_t i = 0; i < n_measure; i++) {
@@ -74,22 +167,59 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&t[0], difference, classes[i]);
+
+        /* do a t-test on cropped execution times, for several thresholds */
+        for (size_t crop = 0; crop < number_percentiles; crop++) {
+            if (difference < percentiles[crop])
+                t_push(&t[1 + crop], difference, classes[i]);
+        }
+
+        /*
+         * do a second order test on the squared distance from the mean,
+         * once the mean is stable
+         */
+        if (t[0].n[0] > min_measure) {
+            double centered = difference - t[0].mean[classes[i]];
+            t_push(&t[1 + number_percentiles], centered * centered, classes[i]);
+        }
     }
 }
 
-static bool report(void)
+/*
+ * Return the largest t value among the informational tests with enough
+ * measurements to be trusted: every cropped test but the first, and the
+ * second order test
+ */
+static double max_derived_t(void)
+{
+    double max_t = 0;
+    for (size_t i = 2; i < number_tests; i++) {
+        if (t[i].n[0] + t[i].n[1] < min_measure)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (x > max_t)
+            max_t = x;
+    }
+    return max_t;
+}
+
+static verdict_t report(void)
 {
     double max_t = fabs(t_compute(t));
     double number_traces_max_t = t->n[0] + t->n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
+    /* The test keeping the fastest 90% of the measurements */
+    double crop_t = fabs(t_compute(&t[1]));
 
     printf("\033[A\033[2K");
     printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measure) {
+    if (number_traces_max_t < min_measure) {
         printf("not enough measurements (%.0f still to go).\n",
                enough_measure - number_traces_max_t);
-        return false;
+        return max_t > t_threshold_bananas || crop_t > t_threshold_bananas
+                   ? LEAKED
+                   : UNDECIDED;
     }
 
     /* max_t: the t statistic value
@@ -101,92 +231,254 @@ static bool report(void)
      * (5/tau)^2: how many measurements we would need to barely
      *            detect the leak, if present. "barely detect the
      *            leak" = have a t value greater than 5.
+     * cropped t: the t value of the test keeping the fastest 90%, which
+     *            decides the verdict.
+     * other t: the largest t value of the other cropped tests and the
+     *          second order test, for information only.
      */
-    printf("max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e.\n", max_t, max_tau,
-           (double) (5 * 5) / (double) (max_tau * max_tau));
+    printf("max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e, "
+           "cropped t: %.2f, other t (info): %.2f.\n",
+           max_t, max_tau, (double) (5 * 5) / (double) (max_tau * max_tau),
+           crop_t, max_derived_t());
 
-    /* Definitely not constant time */
-    if (max_t > t_threshold_bananas)
-        return false;
+    /* Definitely not constant time, no need to measure more */
+    if (max_t > t_threshold_bananas || crop_t > t_threshold_bananas)
+        return LEAKED;
 
-    /* Probably not constant time. */
-    if (max_t > t_threshold_moderate)
-        return false;
+    if (number_traces_max_t >= enough_measure) {
+        /* Probably not constant time, or for the moment, maybe it is */
+        return crop_t > t_threshold_cropped ? FAILED : PASSED;
+    }
 
-    /* For the moment, maybe constant time. */
-    return true;
+    /*
+     * Stop early once the cropped t value predicted at enough_measure stays
+     * well beyond the threshold. A pass is never predicted, since a partial
+     * round can hide a leak.
+     */
+    double crop_tau = crop_t / sqrt(t[1].n[0] + t[1].n[1]);
+    double predicted_t = crop_tau * sqrt(enough_measure);
+    stable = predicted_t > t_threshold_predicted ? stable + 1 : 0;
+    return stable >= stable_batches ? FAILED : UNDECIDED;
 }
 
-static bool doit(int mode)
+static verdict_t doit(int mode)
 {
-    int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(n_measure, sizeof(int64_t));
-    uint8_t *classes = calloc(n_measure, sizeof(uint8_t));
-    uint8_t *input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
+    prepare_inputs(batch.input_data, batch.classes);
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
-        die();
+    measure(batch.before_ticks, batch.after_ticks, batch.input_data, mode);
+    differentiate(batch.exec_times, batch.before_ticks, batch.after_ticks);
+    if (!have_percentiles) {
+        /* The first batch only sets the thresholds, and warms up caches */
+        prepare_percentiles(batch.exec_times);
+        return UNDECIDED;
     }
+    update_statistics(batch.exec_times, batch.classes);
+    return report();
+}
 
-    prepare_inputs(input_data, classes);
+static void init_once(void)
+{
+    init_dut();
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&t[i]);
+    have_percentiles = false;
+    stable = 0;
+}
 
-    measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
+static bool init_batch(void)
+{
+    batch.before_ticks = calloc(n_measure + 1, sizeof(int64_t));
+    batch.after_ticks = calloc(n_measure + 1, sizeof(int64_t));
+    batch.exec_times = calloc(n_measure, sizeof(int64_t));
+    batch.sorted_times = calloc(n_measure, sizeof(int64_t));
+    batch.classes = calloc(n_measure, sizeof(uint8_t));
+    batch.input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
+    t = calloc(number_tests, sizeof(t_ctx));
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
+    return batch.before_ticks && batch.after_ticks && batch.exec_times &&
+           batch.sorted_times && batch.classes && batch.input_data && t;
+}
 
-    return ret;
+static void free_batch(void)
+{
+    free(batch.before_ticks);
+    free(batch.after_ticks);
+    free(batch.exec_times);
+    free(batch.sorted_times);
+    free(batch.classes);
+    free(batch.input_data);
+    free(t);
+    memset(&batch, 0, sizeof(batch));
+    t = NULL;
 }
 
-static void init_once(void)
+#ifdef __linux__
+/* Return the first CPU listed in /sys/devices/system/cpu/isolated, or -1 */
+static int isolated_cpu(const cpu_set_t *allowed)
 {
-    init_dut();
-    t_init(t);
+    FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (!f)
+        return -1;
+
+    int cpu = -1, lo, hi;
+    while (cpu < 0 && fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        if (fscanf(f, "-%d", &hi) != 1)
+            hi = lo;
+        for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, allowed)) {
+                cpu = c;
+                break;
+            }
+        }
+        if (fgetc(f) != ',')
+            break;
+    }
+    fclose(f);
+    return cpu;
 }
 
-static bool TEST_CONST(char *text, int mode)
+/*
+ * Pin the calling thread to one CPU, preferring an isolated one and otherwise
+ * the last one allowed, which is the least likely to service interrupts.
+ * Return true if the previous affinity was saved in old.
+ */
+static bool pin_cpu(cpu_set_t *old)
+{
+    if (sched_getaffinity(0, sizeof(*old), old))
+        return false;
+
+    int cpu = isolated_cpu(old);
+    for (int c = CPU_SETSIZE - 1; cpu < 0 && c >= 0; c--) {
+        if (CPU_ISSET(c, old))
+            cpu = c;
+    }
+    if (cpu < 0)
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return !sched_setaffinity(0, sizeof(set), &set);
+}
+#endif
+
+bool is_op_const(int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    if (!init_batch())
+        die();
+
+#ifdef __linux__
+    cpu_set_t old_cpus;
+    bool pinned = pin_cpu(&old_cpus);
+#endif
 
     for (int cnt = 0; cnt < test_tries; ++cnt) {
-        printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
+        printf("Testing %s...(%d/%d)\n\n", dut_ops[mode].name, cnt,
+               test_tries);
         init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
-            result = doit(mode);
+        verdict_t verdict = UNDECIDED;
+        for (int i = 0; verdict == UNDECIDED && i < max_batches; i++)
+            verdict = doit(mode);
+        result = verdict == PASSED;
         printf("\033[A\033[2K\033[A\033[2K");
-        if (result == true)
+        if (result == true || verdict == LEAKED)
             break;
     }
-    free(t);
+
+#ifdef __linux__
+    if (pinned)
+        sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+#endif
+    free_batch();
     return result;
 }
 
-bool is_insert_head_const(void)
-{
-    return TEST_CONST("insert_head", 0);
-}
+/* Queue size the growth test starts from, doubled for the second class */
+#define growth_size 2000
+
+/*
+ * How far the measured growth exponent may be from the expected one. The
+ * colder caches after building the larger queue alone give constant time
+ * operations an exponent of up to about 0.5.
+ */
+#define growth_slack 0.35
+
+/* Retries of the growth test, which is far less noisy than the t-tests */
+#define growth_tries 3
 
-bool is_insert_tail_const(void)
+/* Return the median time of the measurements of class c in the last batch */
+static double class_median(uint8_t c)
 {
-    return TEST_CONST("insert_tail", 1);
+    size_t n = 0;
+    for (size_t i = 0; i < n_measure; i++) {
+        if (batch.exec_times[i] > 0 && batch.classes[i] == c)
+            batch.sorted_times[n++] = batch.exec_times[i];
+    }
+    if (!n)
+        return 0;
+
+    qsort(batch.sorted_times, n, sizeof(int64_t), cmp_ticks);
+    return batch.sorted_times[n / 2];
 }
 
-bool is_remove_head_const(void)
+/*
+ * Return the exponent b such that an operation of growth g takes 2^b times
+ * as long on 2n elements as on n
+ */
+static double growth_exponent(dut_growth_t g, int n)
 {
-    return TEST_CONST("remove_head", 2);
+    switch (g) {
+    case growth_linear:
+        return 1;
+    case growth_linearithmic:
+        return 1 + log2(log(2.0 * n) / log(n));
+    default:
+        return 0;
+    }
 }
 
-bool is_remove_tail_const(void)
+bool has_op_growth(int mode)
 {
-    return TEST_CONST("remove_tail", 3);
+    const dut_op_t *op = &dut_ops[mode];
+    if (op->growth == growth_constant)
+        return is_op_const(mode);
+
+    bool result = false;
+    if (!init_batch())
+        die();
+
+#ifdef __linux__
+    cpu_set_t old_cpus;
+    bool pinned = pin_cpu(&old_cpus);
+#endif
+
+    double expected = growth_exponent(op->growth, growth_size);
+    for (int cnt = 0; !result && cnt < growth_tries; ++cnt) {
+        printf("Testing %s...(%d/%d)\n\n", op->name, cnt, growth_tries);
+        init_dut();
+        prepare_sized_inputs(batch.input_data, batch.classes, growth_size);
+        measure(batch.before_ticks, batch.after_ticks, batch.input_data, mode);
+        differentiate(batch.exec_times, batch.before_ticks, batch.after_ticks);
+
+        /*
+         * Medians, since the fat right tail that the cropped tests deal with
+         * would otherwise dominate the means
+         */
+        double small = class_median(0), large = class_median(1);
+        double b = small > 0 && large > 0 ? log2(large / small) : NAN;
+        printf("\033[A\033[2K");
+        printf("sizes: %d and %d, exponent: %.2f, expected: %.2f.\n",
+               growth_size, 2 * growth_size, b, expected);
+        result = fabs(b - expected) <= growth_slack;
+        printf("\033[A\033[2K\033[A\033[2K");
+    }
+
+#ifdef __linux__
+    if (pinned)
+        sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+#endif
+    free_batch();
+    return result;
 }
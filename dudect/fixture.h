@@ -4,10 +4,18 @@
 #include <stdbool.h>
 #include "constant.h"
 
-/* Interface to test if function is constant */
-bool is_insert_head_const(void);
-bool is_insert_tail_const(void);
-bool is_remove_head_const(void);
-bool is_remove_tail_const(void);
+/*
+ * Test if the queue operation that dut_ops[mode] runs takes constant time,
+ * whatever the size of the queue
+ */
+bool is_op_const(int mode);
+
+/*
+ * Test if the time of the queue operation that dut_ops[mode] runs grows with
+ * the size of the queue as dut_ops[mode].growth says. Operations that should
+ * take constant time go through is_op_const(), the others are timed on queues
+ * of n and 2n elements.
+ */
+bool has_op_growth(int mode);
 
 #endif
@@ -1,12 +1,15 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "dudect/cpucycles.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -36,7 +39,8 @@
 typedef struct BELE {
     struct BELE *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    uint32_t site;         /* Slot in site table when profiled, else 0 */
+    uint32_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
@@ -44,11 +48,38 @@ typedef struct BELE {
 static block_ele_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/*
+ * Open-addressing hash set of every block on the allocated list, so that
+ * cautious mode validates a block in constant time instead of scanning the
+ * whole list. Linear probing, power-of-two number of slots.
+ */
+static block_ele_t **block_index = NULL;
+static size_t block_index_slots = 0;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
+
+/*
+ * In thread-safe mode, the allocated list and its index are only touched
+ * while holding block_lock.
+ */
+static bool thread_safe_mode = false;
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * In profile mode, each allocation is counted in mem_profile and charged to
+ * the code that called test_malloc, test_calloc or test_strdup. Call sites
+ * live in an open-addressing table keyed by return address, whose last slot
+ * collects the calls that find the table full. Blocks remember their slot, so
+ * a block allocated before profiling started is not counted when freed.
+ */
+static bool profile_mode = false;
+static mem_stats_t mem_profile;
+static mem_site_t mem_site_table[MEM_SITES];
+
 static bool error_occurred = false;
 static char *error_message = "";
 
@@ -58,13 +89,30 @@ static int time_limit = 0xffffffff;
  * Data for managing exceptions
  */
 static jmp_buf env;
+static pthread_t jmp_thread;
 static volatile sig_atomic_t jmp_ready = false;
 static bool time_limited = false;
 
+/* Cycles spent inside exception sections, see exception_cycles() */
+static int64_t section_start;
+static uint64_t section_cycles = 0;
+
 /*
  * Internal functions
  */
 
+static inline void lock_blocks()
+{
+    if (thread_safe_mode)
+        pthread_mutex_lock(&block_lock);
+}
+
+static inline void unlock_blocks()
+{
+    if (thread_safe_mode)
+        pthread_mutex_unlock(&block_lock);
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
@@ -72,6 +120,146 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
+static inline size_t block_hash(const block_ele_t *b)
+{
+    /* Finalizer of MurmurHash3, spreading the aligned low bits around */
+    uint64_t x = (uintptr_t) b;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t) x & (block_index_slots - 1);
+}
+
+static void index_insert(block_ele_t *b)
+{
+    size_t i = block_hash(b);
+    while (block_index[i])
+        i = (i + 1) & (block_index_slots - 1);
+    block_index[i] = b;
+}
+
+/*
+ * Keep the load factor below 3/4 with count blocks, rebuilding the set from
+ * the list. Return false, leaving the set as it was, if it had to grow but
+ * could not.
+ */
+static bool index_reserve(size_t count)
+{
+    if (count * 4 < block_index_slots * 3)
+        return true;
+
+    size_t slots = block_index_slots ? block_index_slots * 2 : 1024;
+    block_ele_t **table = calloc(slots, sizeof(block_ele_t *));
+    if (!table)
+        return false;
+
+    free(block_index);
+    block_index = table;
+    block_index_slots = slots;
+    for (block_ele_t *ab = allocated; ab; ab = ab->next)
+        index_insert(ab);
+    return true;
+}
+
+static bool index_find(const block_ele_t *b)
+{
+    if (!block_index)
+        return false;
+
+    size_t i = block_hash(b);
+    while (block_index[i]) {
+        if (block_index[i] == b)
+            return true;
+        i = (i + 1) & (block_index_slots - 1);
+    }
+    return false;
+}
+
+static void index_remove(const block_ele_t *b)
+{
+    if (!block_index)
+        return;
+
+    size_t mask = block_index_slots - 1;
+    size_t i = block_hash(b);
+    while (block_index[i] != b) {
+        if (!block_index[i])
+            return;
+        i = (i + 1) & mask;
+    }
+
+    /* Shift back later members of the cluster which probed past slot i */
+    for (size_t j = (i + 1) & mask; block_index[j]; j = (j + 1) & mask) {
+        size_t k = block_hash(block_index[j]);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            block_index[i] = block_index[j];
+            i = j;
+        }
+    }
+    block_index[i] = NULL;
+}
+
+static inline int size_class(size_t size)
+{
+    if (size <= 1)
+        return 0;
+    int c = 64 - __builtin_clzll(size - 1);
+    return c < MEM_CLASSES ? c : MEM_CLASSES - 1;
+}
+
+/* Return slot of site in the site table, claiming a free one if needed */
+static uint32_t site_slot(void *site)
+{
+    uint64_t x = (uintptr_t) site;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+
+    /* Slot 0 marks unprofiled blocks, slot MEM_SITES - 1 is the overflow */
+    uint32_t i = x % (MEM_SITES - 2) + 1;
+    for (int probes = 0; probes < MEM_SITES - 2; probes++) {
+        if (mem_site_table[i].site == site)
+            return i;
+        if (!mem_site_table[i].site) {
+            mem_site_table[i].site = site;
+            return i;
+        }
+        i = i == MEM_SITES - 2 ? 1 : i + 1;
+    }
+    return MEM_SITES - 1;
+}
+
+/* Account for a new block, with block_lock held */
+static void profile_alloc(block_ele_t *b, void *site)
+{
+    size_t size = b->payload_size;
+    b->site = site_slot(site);
+    mem_site_t *s = &mem_site_table[b->site];
+    s->allocs++;
+    s->bytes += size;
+    s->live_bytes += size;
+
+    mem_profile.allocs++;
+    mem_profile.bytes += size;
+    mem_profile.live_bytes += size;
+    if (mem_profile.live_bytes > mem_profile.peak_bytes)
+        mem_profile.peak_bytes = mem_profile.live_bytes;
+    mem_profile.classes[size_class(size)]++;
+}
+
+/* Account for freeing a profiled block, with block_lock held */
+static void profile_free(const block_ele_t *b)
+{
+    size_t size = b->payload_size;
+    mem_site_t *s = &mem_site_table[b->site];
+    s->frees++;
+    s->live_bytes -= size;
+
+    mem_profile.frees++;
+    mem_profile.freed_bytes += size;
+    mem_profile.live_bytes -= size;
+}
+
 /*
  * Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
@@ -86,13 +274,7 @@ static block_ele_t *find_header(void *p)
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!index_find(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -122,7 +304,7 @@ static size_t *find_footer(block_ele_t *b)
 /*
  * Implementation of application functions
  */
-void *test_malloc(size_t size)
+static void *alloc_block(size_t size, void *site)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
@@ -145,9 +327,19 @@ void *test_malloc(size_t size)
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
+    new_block->site = 0;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, FILLCHAR, size);
+    lock_blocks();
+    /* A block the index can't hold could never be freed in cautious mode */
+    if (!index_reserve(allocated_count + 1)) {
+        unlock_blocks();
+        free(new_block);
+        report_event(MSG_ERROR, "Couldn't grow the index of allocated blocks");
+        error_occurred = true;
+        return NULL;
+    }
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->next = allocated;
     // cppcheck-suppress nullPointerRedundantCheck
@@ -157,10 +349,19 @@ void *test_malloc(size_t size)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    index_insert(new_block);
+    if (profile_mode)
+        profile_alloc(new_block, site);
+    unlock_blocks();
 
     return p;
 }
 
+void *test_malloc(size_t size)
+{
+    return alloc_block(size, __builtin_return_address(0));
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -168,7 +369,9 @@ void *test_calloc(size_t nelem, size_t elsize)
      * https://danluu.com/malloc-tutorial/
      */
     size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
+    void *ptr = alloc_block(size, __builtin_return_address(0));
+    if (!ptr)
+        return NULL;
     memset(ptr, 0, size);
     return ptr;
 }
@@ -183,6 +386,7 @@ void test_free(void *p)
     if (!p)
         return;
 
+    lock_blocks();
     block_ele_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
@@ -205,16 +409,20 @@ void test_free(void *p)
         allocated = bn;
     if (bn)
         bn->prev = bp;
+    index_remove(b);
+    allocated_count--;
+    if (b->site)
+        profile_free(b);
+    unlock_blocks();
 
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -239,6 +447,68 @@ void set_cautious_mode(bool cautious)
     cautious_mode = cautious;
 }
 
+/*
+ * Set/unset thread-safe mode.
+ * In this mode, test_malloc and test_free may be called from several threads
+ * at once. Switch it only while no other thread is using the harness.
+ */
+void set_thread_safe_mode(bool thread_safe)
+{
+    thread_safe_mode = thread_safe;
+}
+
+/*
+ * Set/unset profile mode.
+ * In this mode, allocations are counted by size class and by call site.
+ */
+void set_profile_mode(bool profile)
+{
+    lock_blocks();
+    profile_mode = profile;
+    unlock_blocks();
+}
+
+/* Take a snapshot of the allocation profile */
+void mem_stats(mem_stats_t *stats)
+{
+    lock_blocks();
+    *stats = mem_profile;
+    unlock_blocks();
+}
+
+/*
+ * Copy up to max call sites with allocations into sites, and return how many
+ * were copied
+ */
+size_t mem_sites(mem_site_t *sites, size_t max)
+{
+    size_t n = 0;
+    lock_blocks();
+    for (int i = 1; i < MEM_SITES && n < max; i++) {
+        if (mem_site_table[i].allocs || mem_site_table[i].live_bytes)
+            sites[n++] = mem_site_table[i];
+    }
+    unlock_blocks();
+    return n;
+}
+
+/*
+ * Clear the allocation profile. Bytes still live stay accounted, so that
+ * freeing them later keeps the totals consistent.
+ */
+void mem_stats_reset()
+{
+    lock_blocks();
+    size_t live = mem_profile.live_bytes;
+    memset(&mem_profile, 0, sizeof(mem_profile));
+    mem_profile.live_bytes = mem_profile.peak_bytes = live;
+    for (int i = 1; i < MEM_SITES; i++) {
+        mem_site_t *s = &mem_site_table[i];
+        s->allocs = s->frees = s->bytes = 0;
+    }
+    unlock_blocks();
+}
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
@@ -266,6 +536,7 @@ bool exception_setup(bool limit_time)
 {
     if (sigsetjmp(env, 1)) {
         /* Got here from longjmp */
+        section_cycles += cpucycles() - section_start;
         jmp_ready = false;
         if (time_limited) {
             alarm(0);
@@ -279,11 +550,13 @@ bool exception_setup(bool limit_time)
     }
 
     /* Got here from initial call */
+    jmp_thread = pthread_self();
     jmp_ready = true;
     if (limit_time) {
         alarm(time_limit);
         time_limited = true;
     }
+    section_start = cpucycles();
     return true;
 }
 
@@ -292,6 +565,8 @@ bool exception_setup(bool limit_time)
  */
 void exception_cancel()
 {
+    if (jmp_ready)
+        section_cycles += cpucycles() - section_start;
     if (time_limited) {
         alarm(0);
         time_limited = false;
@@ -302,14 +577,21 @@ void exception_cancel()
 }
 
 /*
- * Use longjmp to return to most recent exception setup
+ * Use longjmp to return to most recent exception setup.
+ * Only the thread that set it up can jump there, any other one exits.
  */
 void trigger_exception(char *msg)
 {
     error_occurred = true;
     error_message = msg;
-    if (jmp_ready)
+    if (jmp_ready && pthread_equal(pthread_self(), jmp_thread))
         siglongjmp(env, 1);
     else
         exit(1);
 }
+
+/* Return cycles spent inside exception sections so far */
+uint64_t exception_cycles()
+{
+    return section_cycles;
+}
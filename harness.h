@@ -4,6 +4,7 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * This test harness enables us to do stringent testing of code.
@@ -31,6 +32,52 @@ extern int fail_probability;
  */
 void set_cautious_mode(bool cautious);
 
+/*
+ * Set/unset thread-safe mode.
+ * In this mode, test_malloc and test_free may be called from several threads
+ * at once.
+ */
+void set_thread_safe_mode(bool thread_safe);
+
+/* Number of size classes; class c counts payloads up to 2^c bytes */
+#define MEM_CLASSES 40
+
+/* Number of call sites tracked, the last one gathering any others */
+#define MEM_SITES 256
+
+/* Allocation profile, counting payload bytes */
+typedef struct {
+    size_t allocs, frees;
+    size_t bytes, freed_bytes;
+    size_t live_bytes, peak_bytes;
+    size_t classes[MEM_CLASSES];
+} mem_stats_t;
+
+/* Allocations charged to one call site */
+typedef struct {
+    void *site; /* Return address into the caller, NULL for overflow */
+    size_t allocs, frees;
+    size_t bytes, live_bytes;
+} mem_site_t;
+
+/*
+ * Set/unset profile mode.
+ * In this mode, allocations are counted by size class and by call site.
+ */
+void set_profile_mode(bool profile);
+
+/* Take a snapshot of the allocation profile */
+void mem_stats(mem_stats_t *stats);
+
+/*
+ * Copy up to max call sites with allocations into sites, and return how many
+ * were copied
+ */
+size_t mem_sites(mem_site_t *sites, size_t max);
+
+/* Clear the allocation profile, except for bytes still live */
+void mem_stats_reset();
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
@@ -58,6 +105,12 @@ void exception_cancel();
  */
 void trigger_exception(char *msg);
 
+/*
+ * Return total cycles spent between exception_setup and the end of each
+ * section, whether by exception_cancel or by an exception
+ */
+uint64_t exception_cycles();
+
 #else /* !INTERNAL */
 
 /* Tested program use our versions of malloc and free */
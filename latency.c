@@ -0,0 +1,36 @@
+/* Latency histograms, see latency.h */
+
+#include "latency.h"
+
+static inline uint64_t lat_bucket_low(unsigned int i)
+{
+    if (i < 8)
+        return i;
+    return (uint64_t) (8 + i % 8) << (i / 8 - 1);
+}
+
+void lat_merge(lat_hist_t *dst, const lat_hist_t *src)
+{
+    for (int i = 0; i < LAT_BUCKETS; i++)
+        dst->count[i] += src->count[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t lat_quantile(const lat_hist_t *h, int permille)
+{
+    uint64_t rank = (h->total * permille + 999) / 1000, seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen && seen >= rank)
+            return lat_bucket_low(i);
+    }
+    return h->max;
+}
+
+double lat_mean(const lat_hist_t *h)
+{
+    return h->total ? (double) h->sum / h->total : 0;
+}
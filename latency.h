@@ -0,0 +1,47 @@
+#ifndef LAB0_LATENCY_H
+#define LAB0_LATENCY_H
+
+/*
+ * Latency histograms in cycles.
+ * Values below 8 have a bucket each, larger ones have 8 buckets per power of
+ * two, so a bucket is never more than 1/8 wider than its lower bound.
+ */
+
+#include <stdint.h>
+
+#define LAT_BUCKETS (62 * 8)
+
+typedef struct {
+    uint64_t count[LAT_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} lat_hist_t;
+
+static inline unsigned int lat_bucket(uint64_t v)
+{
+    if (v < 8)
+        return v;
+    int b = 63 - __builtin_clzll(v);
+    return (b - 2) * 8 + ((v >> (b - 3)) & 7);
+}
+
+static inline void lat_record(lat_hist_t *h, uint64_t v)
+{
+    h->count[lat_bucket(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Add the samples of src to dst */
+void lat_merge(lat_hist_t *dst, const lat_hist_t *src);
+
+/* Return lower bound of the bucket holding the given per-mille quantile */
+uint64_t lat_quantile(const lat_hist_t *h, int permille);
+
+/* Return mean of the samples, 0 if there are none */
+double lat_mean(const lat_hist_t *h);
+
+#endif /* LAB0_LATENCY_H */
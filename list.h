@@ -378,6 +378,30 @@ static inline void list_move_tail(struct list_head *node,
 #define list_for_each(node, head) \
     for (node = (head)->next; node != (head); node = node->next)
 
+/**
+ * list_prefetch() - hint that the memory at an address will soon be read
+ * @ptr: pointer to the memory, which does not need to be valid
+ */
+#if defined(__GNUC__)
+#define list_prefetch(ptr) __builtin_prefetch(ptr)
+#else
+#define list_prefetch(ptr) ((void) (ptr))
+#endif
+
+/**
+ * list_for_each_prefetch - iterate over list nodes, prefetching ahead
+ * @node: list_head pointer used as iterator
+ * @head: pointer to the head of the list
+ *
+ * Same as list_for_each, but the node after the next one is prefetched
+ * while visiting each node. On lists too long for the caches, the misses
+ * then overlap with the work done on the nodes instead of adding up.
+ */
+#define list_for_each_prefetch(node, head)                               \
+    for (node = (head)->next;                                            \
+         node != (head) && (list_prefetch(node->next->next), 1);         \
+         node = node->next)
+
 /**
  * list_for_each_entry - iterate over list entries
  * @entry: pointer used as iterator
@@ -428,6 +452,28 @@ static inline void list_move_tail(struct list_head *node,
          &entry->member != (head); entry = safe,                           \
         safe = list_entry(safe->member.next, __typeof__(*entry), member))
 
+/**
+ * list_for_each_entry_safe_prefetch - iterate over list entries and allow
+ *                                     deletes, prefetching ahead
+ * @entry: pointer used as iterator
+ * @safe: @type pointer used to store info for next entry in list
+ * @head: pointer to the head of the list
+ * @member: name of the list_head member variable in struct type of @entry
+ *
+ * Same as list_for_each_entry_safe, but the entry after @safe is prefetched
+ * while visiting @entry. @safe may be the head of the list, so only its
+ * list_head member can be dereferenced.
+ *
+ * FIXME: remove dependency of __typeof__ extension
+ */
+#define list_for_each_entry_safe_prefetch(entry, safe, head, member)       \
+    for (entry = list_entry((head)->next, __typeof__(*entry), member),     \
+        safe = list_entry(entry->member.next, __typeof__(*entry), member); \
+         &entry->member != (head) &&                                       \
+         (list_prefetch(safe->member.next), 1);                            \
+         entry = safe,                                                     \
+        safe = list_entry(safe->member.next, __typeof__(*entry), member))
+
 #undef __LIST_HAVE_TYPEOF
 
 #ifdef __cplusplus
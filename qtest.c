@@ -1,9 +1,17 @@
 /* Implementation of testing code for queue code */
 
 #include <errno.h>
+#include <execinfo.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +20,11 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 
@@ -33,7 +46,9 @@
  */
 #include "queue.h"
 
+#include "bintrace.h"
 #include "console.h"
+#include "latency.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -43,25 +58,36 @@
 /*
  * How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
 
+/*
+ * Queues up to this size are fully validated after every command, larger ones
+ * only every validate_period commands, see show_queue().
+ */
+#define VALIDATE_SMALL 4096
+#define VALIDATE_PERIOD 16
+static int validate_period = VALIDATE_PERIOD;
+static int validate_skipped = 0;
 
 /* Global variables */
 
-/* List being tested */
-typedef struct {
-    struct list_head *l;
-    /* meta data of list */
-    int size;
-} list_head_meta_t;
+/*
+ * Queues being tested, linked through their chain field in order of creation.
+ * The element count lives in each queue itself (see queue_t) and is checked
+ * against the size field here, which the commands maintain independently,
+ * as they do the sum field for the values in the queue.
+ */
+static LIST_HEAD(chain);
+static int chain_size = 0;
+static int next_id = 0;
 
-static list_head_meta_t l_meta;
+/* Stands in for the selected queue while there is none */
+static queue_chain_t no_queue = {.q = NULL, .size = 0, .sum = 0, .id = -1};
 
-/* Number of elements in queue */
-static size_t lcnt = 0;
+/* Queue the commands operate on */
+static queue_chain_t *current = &no_queue;
 
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST;
@@ -69,12 +95,81 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Element allocation mode, see q_set_alloc_mode() */
+static int alloc_mode = Q_ALLOC_MALLOC;
+
+/* Number of threads used by sort, see q_sort_parallel() */
+static int sort_threads = 1;
+
+/* Whether rh and rt without expected value use q_remove_head_ref() */
+static int zero_copy = 0;
+
+/* Whether dedup hashes instead of relying on a sorted queue */
+static int hash_dedup = 0;
+
+/* Whether allocations are profiled, see memstat */
+static int mem_profiling = 0;
+
+/* Whether sorts keep their scratch space, see q_sort_reserve() */
+static int sort_scratch = 0;
+
+/* Work and time of the latest sort of one kind, see sortstat */
+typedef struct {
+    q_sort_stats_t stats;
+    int size;
+    double msecs;
+    long long misses; /* -1 if they could not be counted */
+    struct timespec start;
+    bool done;
+} sort_record_t;
+
+static sort_record_t last_sort, last_linux_sort;
+
+/* Number of call sites listed by memstat */
+#define MEMSTAT_SITES 16
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
 /* Forward declarations */
 static bool show_queue(int vlevel);
+static bool validate_queue(int vlevel);
+
+/*
+ * Contribution of value s to the sum of a queue. Summing makes the checksum
+ * independent of order, so only insertions and removals change it.
+ */
+static inline uint64_t value_hash(const char *s)
+{
+    return s ? str_hash(s) : 0;
+}
+
+/* Record a queue operation with argc integer arguments, see -r */
+static void record_op(bt_op_t op, int argc, ...)
+{
+    if (!bt_recording())
+        return;
+
+    va_list ap;
+    va_start(ap, argc);
+    bt_put_op(op);
+    while (argc--)
+        bt_put_int(va_arg(ap, int));
+    va_end(ap);
+}
+
+/* Record which queue is selected, -1 for none */
+static void record_select()
+{
+    record_op(BT_SELECT, 1, current->id);
+}
+
+/* Select queue q, or none if q is the chain head */
+static void select_queue(struct list_head *q)
+{
+    current = q == &chain ? &no_queue : list_entry(q, queue_chain_t, chain);
+}
 
 static bool do_free(int argc, char *argv[])
 {
@@ -84,24 +179,29 @@ static bool do_free(int argc, char *argv[])
     }
 
     bool ok = true;
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
+    record_op(BT_FREE, 0);
     if (exception_setup(true))
-        q_free(l_meta.l);
+        q_free(current->q);
     exception_cancel();
-    set_cautious_mode(true);
 
-    l_meta.size = 0;
-    l_meta.l = NULL;
-    lcnt = 0;
+    /* Select the queue created before, or else after, the freed one */
+    if (current != &no_queue) {
+        queue_chain_t *freed = current;
+        select_queue(freed->chain.prev != &chain ? freed->chain.prev
+                                                 : freed->chain.next);
+        list_del(&freed->chain);
+        free(freed);
+        chain_size--;
+    }
+    record_select();
     show_queue(3);
 
     size_t bcnt = allocation_check();
-    if (bcnt > 0) {
+    if (!chain_size && bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
         ok = false;
@@ -111,28 +211,127 @@ static bool do_free(int argc, char *argv[])
 }
 
 static bool do_new(int argc, char *argv[])
+{
+    bool ring = argc == 2 && !strcmp(argv[1], "ring");
+    if (argc != 1 && !ring) {
+        report(1, "%s takes no arguments, or 'ring'", argv[0]);
+        return false;
+    }
+
+    queue_chain_t *ctx = malloc(sizeof(queue_chain_t));
+    if (!ctx) {
+        report(1, "ERROR: Could not allocate queue context");
+        return false;
+    }
+    ctx->q = NULL;
+    error_check();
+
+    if (exception_setup(true))
+        ctx->q = ring ? q_new_ring() : q_new();
+    exception_cancel();
+
+    if (ctx->q) {
+        ctx->size = 0;
+        ctx->sum = 0;
+        ctx->id = next_id++;
+        list_add_tail(&ctx->chain, &chain);
+        chain_size++;
+        current = ctx;
+        record_op(BT_NEW, 1, ring);
+        report(3, "Queue %d selected", current->id);
+    } else {
+        free(ctx);
+    }
+    show_queue(3);
+
+    return !error_check();
+}
+
+static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    bool ok = true;
-    if (l_meta.l) {
-        report(3, "Freeing old queue");
-        ok = do_free(argc, argv);
+    if (!chain_size) {
+        report(1, "No queue to select");
+        return false;
     }
-    error_check();
 
-    if (exception_setup(true)) {
-        l_meta.l = q_new();
-        l_meta.size = 0;
+    /* Wrap around from the first queue to the last */
+    struct list_head *q = current->chain.prev;
+    select_queue(q == &chain ? chain.prev : q);
+    report(2, "Queue %d selected", current->id);
+    record_select();
+    show_queue(3);
+    return true;
+}
+
+static bool do_next(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
     }
-    exception_cancel();
-    lcnt = 0;
+
+    if (!chain_size) {
+        report(1, "No queue to select");
+        return false;
+    }
+
+    /* Wrap around from the last queue to the first */
+    struct list_head *q = current->chain.next;
+    select_queue(q == &chain ? chain.next : q);
+    report(2, "Queue %d selected", current->id);
+    record_select();
     show_queue(3);
+    return true;
+}
 
-    return ok && !error_check();
+/* Each network client has its own selected queue, see run_server() */
+static int session_save(void)
+{
+    return current->id;
+}
+
+static void session_restore(int id)
+{
+    if (current->id == id)
+        return;
+
+    queue_chain_t *ctx;
+    current = &no_queue;
+    list_for_each_entry (ctx, &chain, chain) {
+        if (ctx->id == id) {
+            current = ctx;
+            break;
+        }
+    }
+    record_select();
+}
+
+static bool do_select(int argc, char *argv[])
+{
+    int id;
+    if (argc != 2 || !get_int(argv[1], &id)) {
+        report(1, "%s needs a queue id", argv[0]);
+        return false;
+    }
+
+    queue_chain_t *ctx;
+    list_for_each_entry (ctx, &chain, chain) {
+        if (ctx->id == id) {
+            current = ctx;
+            report(2, "Queue %d selected", current->id);
+            record_select();
+            show_queue(3);
+            return true;
+        }
+    }
+
+    report(1, "No queue with id %d", id);
+    return false;
 }
 
 /*
@@ -151,25 +350,46 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
-/* insert head */
-static bool do_ih(int argc, char *argv[])
+/* How many random strings are generated for each bulk insertion */
+#define RAND_BATCH 1024
+
+/*
+ * Fewest insertions that ih and it make through the bulk API. Smaller counts
+ * go through q_insert_head and q_insert_tail, so that the traces keep
+ * testing them.
+ */
+#define BULK_MIN 1000
+
+/*
+ * In simulation mode, commands test whether the time of their queue operation
+ * grows with the queue size as expected instead of running it, see
+ * has_op_growth()
+ */
+static bool simulate(int mode, int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = is_insert_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    const char *growth = dut_growth_names[dut_ops[mode].growth];
+    bool ok = has_op_growth(mode);
+    if (!ok) {
+        report(1, "ERROR: Probably not %s time", growth);
+        return false;
     }
+    report(1, "Probably %s time", growth);
+    return ok;
+}
+
+static bool do_insert(int option, int argc, char *argv[])
+{
+    // option 0 is for insert head; option 1 is for insert tail
+    if (simulation)
+        return simulate(option ? test_insert_tail : test_insert_head, argc,
+                        argv);
 
-    char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RAND_BATCH][MAX_RANDSTR_LEN];
+    char *strs[RAND_BATCH];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -185,50 +405,88 @@ static bool do_ih(int argc, char *argv[])
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
+    if (!strcmp(inserts, "RAND"))
         need_rand = true;
-        inserts = randstr_buf;
-    }
+    for (int i = 0; i < RAND_BATCH; i++)
+        strs[i] = need_rand ? randstr_buf[i] : inserts;
 
-    if (!l_meta.l)
-        report(3, "Warning: Calling insert head on null queue");
+    if (!current->q)
+        report(3, "Warning: Calling insert %s on null queue",
+               option ? "tail" : "head");
     error_check();
 
+    bool bulk = reps >= BULK_MIN;
+    int inserted = 0;
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_head(l_meta.l, inserts);
-            if (rval) {
-                lcnt++;
-                l_meta.size++;
-                char *cur_inserts =
-                    list_entry(l_meta.l->next, element_t, list)->value;
+        for (int r = 0; ok && r < reps;) {
+            int n = bulk ? reps - r : 1, cnt = 1, k;
+            if (need_rand) {
+                cnt = n = n < RAND_BATCH ? n : RAND_BATCH;
+                for (int i = 0; i < n; i++)
+                    fill_rand_string(randstr_buf[i], sizeof(randstr_buf[i]));
+            }
+
+            if (bulk)
+                k = option ? q_insert_tail_bulk(current->q, strs, cnt, n)
+                           : q_insert_head_bulk(current->q, strs, cnt, n);
+            else
+                k = option ? q_insert_tail(current->q, strs[0])
+                           : q_insert_head(current->q, strs[0]);
+            if (k && bt_recording()) {
+                bt_put_op(BT_INSERT);
+                bt_put_int(option);
+                bt_put_int(k);
+                bt_put_int(cnt < k ? cnt : k);
+                for (int i = 0; i < cnt && i < k; i++)
+                    bt_put_str(strs[i]);
+            }
+
+            if (k) {
+                /*
+                 * Newest element, and the one inserted right before it if
+                 * this command inserted more than one
+                 */
+                q_iter_t it;
+                q_iter_init(&it, current->q, option);
+                char *cur_inserts = q_iter_next(&it)->value;
+                element_t *last = q_iter_next(&it);
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
-                } else if (r == 0 && inserts == cur_inserts) {
+                } else if (cur_inserts == strs[(k - 1) % cnt]) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if ((k > 1 || inserted) && last->value == cur_inserts &&
+                           alloc_mode != Q_ALLOC_INTERN) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
                     ok = false;
                     break;
                 }
-                lasts = cur_inserts;
-            } else {
+                /* String i of the batch went in once every cnt insertions */
+                for (int i = 0; i < cnt && i < k; i++)
+                    current->sum +=
+                        value_hash(strs[i]) * ((k - i + cnt - 1) / cnt);
+                current->size += k;
+                inserted += k;
+                r += k;
+            }
+
+            if (k < n) {
+                /* Each failed insertion uses up one repetition */
+                char *failed = strs[k % cnt];
                 fail_count++;
+                r++;
                 if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
+                    report(2, "Insertion of %s failed", failed);
                 else {
                     report(1,
                            "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                           failed, fail_count);
                     ok = false;
                 }
             }
@@ -241,79 +499,63 @@ static bool do_ih(int argc, char *argv[])
     return ok;
 }
 
-/* insert tail */
-static bool do_it(int argc, char *argv[])
+/* insert head */
+static inline bool do_ih(int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = is_insert_tail_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
-
-    char randstr_buf[MAX_RANDSTR_LEN];
-    int reps = 1;
-    bool ok = true, need_rand = false;
-    if (argc != 2 && argc != 3) {
-        report(1, "%s needs 1-2 arguments", argv[0]);
-        return false;
-    }
-
-    char *inserts = argv[1];
-    if (argc == 3) {
-        if (!get_int(argv[2], &reps)) {
-            report(1, "Invalid number of insertions '%s'", argv[2]);
-            return false;
-        }
-    }
+    return do_insert(0, argc, argv);
+}
 
-    if (!strcmp(inserts, "RAND")) {
-        need_rand = true;
-        inserts = randstr_buf;
-    }
+/* insert tail */
+static inline bool do_it(int argc, char *argv[])
+{
+    return do_insert(1, argc, argv);
+}
 
-    if (!l_meta.l)
-        report(3, "Warning: Calling insert tail on null queue");
+/*
+ * rh/rt without an expected value while zero_copy is set, removing through
+ * q_remove_head_ref() and q_remove_tail_ref() instead of copying the string
+ */
+static bool do_remove_ref(int option)
+{
+    bool ok = true;
+    if (!current->size)
+        report(3, "Warning: Calling remove head on empty queue");
     error_check();
 
-    if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_tail(l_meta.l, inserts);
-            if (rval) {
-                lcnt++;
-                l_meta.size++;
-                char *cur_inserts =
-                    list_entry(l_meta.l->prev, element_t, list)->value;
-                if (!cur_inserts) {
-                    report(1, "ERROR: Failed to save copy of string in queue");
-                    ok = false;
-                }
-            } else {
-                fail_count++;
-                if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
-                else {
-                    report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
-                    ok = false;
-                }
-            }
-            ok = ok && !error_check();
+    element_t *re = NULL;
+    const char *value = NULL;
+    record_op(BT_REMOVE, 2, option, -1);
+    if (exception_setup(true))
+        re = option ? q_remove_tail_ref(current->q, &value, NULL)
+                    : q_remove_head_ref(current->q, &value, NULL);
+    exception_cancel();
+
+    if (re) {
+        if (!value) {
+            report(1, "ERROR: Failed to store removed value");
+            ok = false;
+        } else {
+            report(2, "Removed %.*s from queue", string_length, value);
+        }
+        // q_remove_head_ref and q_remove_tail_ref are not responsible for
+        // releasing node
+        current->sum -= value_hash(re->value);
+        q_release_element(re);
+        current->size--;
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Removal from queue failed");
+        } else {
+            report(1, "ERROR: Removal from queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
         }
     }
-    exception_cancel();
+
     show_queue(3);
-    return ok;
+
+    return ok && !error_check();
 }
 
 static bool do_remove(int option, int argc, char *argv[])
@@ -325,19 +567,9 @@ static bool do_remove(int option, int argc, char *argv[])
      * out the exact reasons and resolve later.
      */
 #if !defined(__aarch64__)
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = option ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(option ? test_remove_tail : test_remove_head, argc,
+                        argv);
 #endif
 
     if (argc != 1 && argc != 2) {
@@ -345,6 +577,10 @@ static bool do_remove(int option, int argc, char *argv[])
         return false;
     }
 
+    /* Removing by reference skips the copy, and so the checks of it below */
+    if (argc == 1 && zero_copy)
+        return do_remove_ref(option);
+
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
         report(1,
@@ -371,14 +607,15 @@ static bool do_remove(int option, int argc, char *argv[])
     memset(removes + 1, 'X', string_length + STRINGPAD - 1);
     removes[string_length + STRINGPAD] = '\0';
 
-    if (!l_meta.size)
+    if (!current->size)
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
 
     element_t *re = NULL;
+    record_op(BT_REMOVE, 2, option, string_length + 1);
     if (exception_setup(true))
-        re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
-                    : q_remove_head(l_meta.l, removes, string_length + 1);
+        re = option ? q_remove_tail(current->q, removes, string_length + 1)
+                    : q_remove_head(current->q, removes, string_length + 1);
     exception_cancel();
 
     bool is_null = re ? false : true;
@@ -386,6 +623,7 @@ static bool do_remove(int option, int argc, char *argv[])
     if (!is_null) {
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
+        current->sum -= value_hash(re->value);
         q_release_element(re);
 
         removes[string_length + STRINGPAD] = '\0';
@@ -409,8 +647,7 @@ static bool do_remove(int option, int argc, char *argv[])
         } else {
             report(2, "Removed %s from queue", removes);
         }
-        lcnt--;
-        l_meta.size--;
+        current->size--;
     } else {
         fail_count++;
         if (!check && fail_count < fail_limit) {
@@ -422,7 +659,7 @@ static bool do_remove(int option, int argc, char *argv[])
         }
     }
 
-    if (ok && check && strcmp(removes, checks)) {
+    if (ok && check && !str_eq(removes, checks)) {
         report(1, "ERROR: Removed value %s != expected value %s", removes,
                checks);
         ok = false;
@@ -454,24 +691,25 @@ static bool do_rhq(int argc, char *argv[])
     }
 
     bool ok = true;
-    if (!l_meta.size)
+    if (!current->size)
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
 
     element_t *re = NULL;
 
+    record_op(BT_REMOVE, 2, 0, 0);
     if (exception_setup(true))
-        re = q_remove_head(l_meta.l, NULL, 0);
+        re = q_remove_head(current->q, NULL, 0);
     exception_cancel();
 
     if (re) {
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
+        current->sum -= value_hash(re->value);
         q_release_element(re);
 
         report(2, "Removed element from queue");
-        lcnt--;
-        l_meta.size--;
+        current->size--;
     } else {
         fail_count++;
         if (fail_count < fail_limit)
@@ -486,63 +724,216 @@ static bool do_rhq(int argc, char *argv[])
     return ok && !error_check();
 }
 
-static bool do_dedup(int argc, char *argv[])
+static bool do_remove_n(int option, int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    // option 0 is for remove head; option 1 is for remove tail
+    int n;
+    if (argc != 2 || !get_int(argv[1], &n) || n < 1) {
+        report(1, "%s needs a positive number of elements", argv[0]);
         return false;
     }
 
-    // establish checking list dup_value
-    struct list_head *dup_value = malloc(sizeof(*dup_value));
-    if (!dup_value) {
-        report(
-            1,
-            "INTERNAL ERROR.  Could not allocate space for duplicate checking");
-        return false;
-    }
-    INIT_LIST_HEAD(dup_value);
-    element_t *item = NULL;
-    if (l_meta.l && !list_empty(l_meta.l)) {
-        bool last_dup = false;
+    bool ok = true;
+    if (current->size < n)
+        report(3, "Warning: Removing %d elements from queue of %d", n,
+               current->size);
+    error_check();
 
-        list_for_each_entry (item, l_meta.l, list) {
-            element_t *next_item;
-            if (item->list.next == l_meta.l)
-                break;
-            next_item = list_entry(item->list.next, element_t, list);
+    LIST_HEAD(drained);
+    int cnt = 0;
+    record_op(BT_REMOVE_RANGE, 1, option ? -n : n);
+    if (exception_setup(true))
+        cnt = q_remove_range(current->q, option ? -n : n, &drained);
+    exception_cancel();
 
-            // assume queue has been sorted
-            bool match = !strcmp(item->value, next_item->value);
-            if (match && !last_dup) {
-                int n = strlen(item->value) + 1;
-                char *str = malloc(sizeof(*str) * n);
-                element_t *entry = malloc(sizeof(*entry));
-                if (!str || !entry) {
-                    report(1,
-                           "INTERNAL ERROR.  Could not allocate space for "
-                           "duplicate checking");
-                    free(str);
+    int released = 0;
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &drained, list) {
+        current->sum -= value_hash(e->value);
+        q_release_element(e);
+        released++;
+    }
 
-                    if (list_empty(dup_value)) {
-                        free(dup_value);
-                        return false;
-                    }
-                    element_t *cur, *safe;
-                    list_for_each_entry_safe (cur, safe, dup_value, list) {
-                        free(cur->value);
-                        free(cur);
-                    }
-                    free(dup_value);
+    if (released != cnt) {
+        report(1, "ERROR: Removed %d elements but reported %d", released, cnt);
+        ok = false;
+    }
+    current->size -= released;
 
-                    return false;
-                }
-                strncpy(str, item->value, n);
-                entry->value = str;
+    if (released == n) {
+        report(2, "Removed %d elements from queue", released);
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Removed only %d of %d elements", released, n);
+        } else {
+            report(1,
+                   "ERROR: Removed only %d of %d elements (%d failures total)",
+                   released, n, fail_count);
+            ok = false;
+        }
+    }
 
-                list_add_tail(&entry->list, dup_value);
-            }
-            last_dup = match;
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* remove n elements from head at once */
+static inline bool do_rhn(int argc, char *argv[])
+{
+    return do_remove_n(0, argc, argv);
+}
+
+/* remove n elements from tail at once */
+static inline bool do_rtn(int argc, char *argv[])
+{
+    return do_remove_n(1, argc, argv);
+}
+
+/* A value of the queue, with its value_hash() */
+struct hashed_value {
+    uint64_t hash;
+    const char *s;
+};
+
+/* Order values by hash, and equal hashes by value */
+static int cmp_hashed_value(const void *a, const void *b)
+{
+    const struct hashed_value *ha = a, *hb = b;
+    if (ha->hash != hb->hash)
+        return ha->hash < hb->hash ? -1 : 1;
+    return str_cmp(ha->s, hb->s);
+}
+
+/*
+ * Compute in *size and *sum the element count and value sum that dedup must
+ * leave in the current queue: values occurring once in the queue, or once in
+ * a row if dedup assumes it sorted. Return false if out of memory.
+ */
+static bool dedup_survivors(bool sorted, int *size, uint64_t *sum)
+{
+    int n = q_size(current->q);
+    q_iter_t it;
+
+    *size = 0;
+    *sum = 0;
+    if (sorted) {
+        element_t *prev = NULL;
+        int run = 0;
+        q_iter_init(&it, current->q, false);
+        for (element_t *e; (e = q_iter_next(&it)); prev = e) {
+            if (prev && str_eq(prev->value, e->value)) {
+                run++;
+                continue;
+            }
+            if (run == 1) {
+                *sum += value_hash(prev->value);
+                (*size)++;
+            }
+            run = 1;
+        }
+        if (run == 1) {
+            *sum += value_hash(prev->value);
+            (*size)++;
+        }
+        return true;
+    }
+
+    struct hashed_value *v = malloc((n + 1) * sizeof(*v));
+    if (!v)
+        return false;
+    int i = 0;
+    q_iter_init(&it, current->q, false);
+    for (element_t *e; i < n && (e = q_iter_next(&it)); i++) {
+        v[i].hash = value_hash(e->value);
+        v[i].s = e->value;
+    }
+    n = i;
+    qsort(v, n, sizeof(*v), cmp_hashed_value);
+
+    for (i = 0; i < n;) {
+        int j = i + 1;
+        while (j < n && !cmp_hashed_value(&v[i], &v[j]))
+            j++;
+        if (j - i == 1) {
+            *sum += v[i].hash;
+            (*size)++;
+        }
+        i = j;
+    }
+    free(v);
+    return true;
+}
+
+static bool do_dedup(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    /* Known before the call, so removing the wrong elements is caught */
+    int expect_size = 0;
+    uint64_t expect_sum = 0;
+    if (current->q &&
+        !dedup_survivors(!hash_dedup, &expect_size, &expect_sum)) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for duplicate "
+               "checking");
+        return false;
+    }
+
+    // establish checking list dup_value
+    struct list_head *dup_value = malloc(sizeof(*dup_value));
+    if (!dup_value) {
+        report(
+            1,
+            "INTERNAL ERROR.  Could not allocate space for duplicate checking");
+        return false;
+    }
+    INIT_LIST_HEAD(dup_value);
+    element_t *item = NULL;
+    /* Hashed dedup accepts any order, so only a sorted queue is checked */
+    if (!hash_dedup && current->q && q_size(current->q)) {
+        bool last_dup = false;
+        q_iter_t it;
+
+        q_iter_init(&it, current->q, false);
+        item = q_iter_next(&it);
+        for (element_t *next_item; (next_item = q_iter_next(&it));
+             item = next_item) {
+
+            // assume queue has been sorted
+            bool match = str_eq(item->value, next_item->value);
+            if (match && !last_dup) {
+                int n = strlen(item->value) + 1;
+                char *str = malloc(sizeof(*str) * n);
+                element_t *entry = malloc(sizeof(*entry));
+                if (!str || !entry) {
+                    report(1,
+                           "INTERNAL ERROR.  Could not allocate space for "
+                           "duplicate checking");
+                    free(str);
+
+                    if (list_empty(dup_value)) {
+                        free(dup_value);
+                        return false;
+                    }
+                    element_t *cur, *safe;
+                    list_for_each_entry_safe (cur, safe, dup_value, list) {
+                        free(cur->value);
+                        free(cur);
+                    }
+                    free(dup_value);
+
+                    return false;
+                }
+                strncpy(str, item->value, n);
+                entry->value = str;
+
+                list_add_tail(&entry->list, dup_value);
+            }
+            last_dup = match;
             /*
              * To avoid allocate duplicated string in checking list
              * dup_value, a variable last_dup is used to record whether
@@ -566,8 +957,10 @@ static bool do_dedup(int argc, char *argv[])
         }
     }
     bool ok = true;
+    record_op(BT_DEDUP, 1, hash_dedup);
     if (exception_setup(true))
-        ok = q_delete_dup(l_meta.l);
+        ok = hash_dedup ? q_delete_dup_unsorted(current->q)
+                        : q_delete_dup(current->q);
     exception_cancel();
 
     if (!ok) {
@@ -590,15 +983,17 @@ static bool do_dedup(int argc, char *argv[])
     // Checking if there are duplicated string remain on queue.
     // If the string is duplicated at beginning, and remain
     // on the queue after call of q_dedup, return false.
-    if (l_meta.size && !list_empty(dup_value)) {
+    if (current->size && !list_empty(dup_value)) {
         element_t *next_dup = list_first_entry(dup_value, element_t, list);
-        list_for_each_entry (item, l_meta.l, list) {
-            int cmp = strcmp(item->value, next_dup->value);
+        q_iter_t it;
+        q_iter_init(&it, current->q, false);
+        while ((item = q_iter_next(&it))) {
+            int cmp = str_cmp(item->value, next_dup->value);
 
             // assume queue has been sorted
             while (cmp > 0 && next_dup->list.next != dup_value) {
                 next_dup = list_first_entry(&next_dup->list, element_t, list);
-                cmp = strcmp(item->value, next_dup->value);
+                cmp = str_cmp(item->value, next_dup->value);
             }
             if (!cmp) {
                 report(1, "ERROR: Duplicate string remain on queue");
@@ -610,6 +1005,11 @@ static bool do_dedup(int argc, char *argv[])
                 break;
         }
     }
+
+    current->size = expect_size;
+    current->sum = expect_sum;
+    if (current->q && !validate_queue(1))
+        ok = false;
     show_queue(3);
 
     if (list_empty(dup_value)) {
@@ -628,18 +1028,22 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_reverse, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Calling reverse on null queue");
     error_check();
 
+    record_op(BT_REVERSE, 0);
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_reverse(l_meta.l);
+        q_reverse(current->q);
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -649,6 +1053,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_size, argc, argv);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -668,25 +1075,26 @@ static bool do_size(int argc, char *argv[])
     }
 
     int cnt = 0;
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Calling size on null queue");
     error_check();
 
+    record_op(BT_SIZE, 1, reps);
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            cnt = q_size(l_meta.l);
+            cnt = q_size(current->q);
             ok = ok && !error_check();
         }
     }
     exception_cancel();
 
     if (ok) {
-        if (lcnt == cnt) {
+        if (current->size == cnt) {
             report(2, "Queue size = %d", cnt);
         } else {
             report(1,
                    "ERROR: Computed queue size as %d, but correct value is %d",
-                   cnt, (int) lcnt);
+                   cnt, current->size);
             ok = false;
         }
     }
@@ -696,42 +1104,195 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/*
+ * Return the cache misses of this process so far, those of its threads that
+ * have exited included, or -1 if the CPU or the kernel does not count them.
+ */
+static long long cache_misses(void)
+{
+#ifdef __linux__
+    static int fd = -2; /* Not opened yet */
+
+    if (fd == -2) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* Threads started later, like those of q_sort_parallel, count too */
+        attr.inherit = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                     PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0)
+            fd = -1;
+    }
+
+    long long count;
+    if (fd >= 0 && read(fd, &count, sizeof(count)) == sizeof(count))
+        return count;
+#endif
+    return -1;
+}
+
+/* Start measuring a sort of size elements into r */
+static void sort_record_begin(sort_record_t *r, int size)
+{
+    /* Forget the work of sorts not measured, e.g. while replaying */
+    q_sort_stats(&r->stats);
+    r->size = size;
+    r->misses = cache_misses();
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+}
+
+static void sort_record_end(sort_record_t *r)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long misses = cache_misses();
+
+    r->msecs = (end.tv_sec - r->start.tv_sec) * 1e3 +
+               (end.tv_nsec - r->start.tv_nsec) / 1e6;
+    r->misses = r->misses < 0 || misses < 0 ? -1 : misses - r->misses;
+    q_sort_stats(&r->stats);
+    r->done = true;
+}
+
 bool do_sort(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_sort, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Calling sort on null queue");
     error_check();
 
-    int cnt = q_size(l_meta.l);
+    int cnt = q_size(current->q);
     if (cnt < 2)
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    /* q_sort must not allocate, so its scratch space is reserved first */
+    if (!q_sort_reserve(cnt))
+        report(3, "Warning: Could not reserve sort scratch space");
+
+    record_op(BT_SORT, 1, sort_threads);
+    sort_record_begin(&last_sort, cnt);
     set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_sort(l_meta.l);
+    if (exception_setup(true)) {
+        if (sort_threads > 1)
+            q_sort_parallel(current->q, sort_threads);
+        else
+            q_sort(current->q);
+    }
     exception_cancel();
     set_noallocate_mode(false);
+    sort_record_end(&last_sort);
+    if (!sort_scratch)
+        q_sort_reserve(0);
 
     bool ok = true;
-    if (l_meta.size) {
-        for (struct list_head *cur_l = l_meta.l->next;
-             cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
+
+    if (current->size) {
+        q_iter_t it;
+        q_iter_init(&it, current->q, false);
+        element_t *item = q_iter_next(&it), *next_item;
+        while (--cnt > 0 && (next_item = q_iter_next(&it))) {
             /* Ensure each element in ascending order */
             /* FIXME: add an option to specify sorting order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
             if (strcasecmp(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
+            item = next_item;
+        }
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_merge(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!chain_size) {
+        report(1, "No queue to merge");
+        return false;
+    }
+
+    int total = 0;
+    uint64_t sum = 0;
+    queue_chain_t *ctx;
+    list_for_each_entry (ctx, &chain, chain) {
+        total += ctx->size;
+        sum += ctx->sum;
+    }
+    error_check();
+
+    size_t bcnt = allocation_check();
+    int len = 0;
+    record_op(BT_MERGE, 0);
+    if (exception_setup(true))
+        len = q_merge(&chain);
+    exception_cancel();
+
+    bool ok = true;
+    if (allocation_check() != bcnt) {
+        report(1, "ERROR: Merging changed the number of allocated blocks");
+        ok = false;
+    }
+
+    if (len < 0) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Merge failed");
+        } else {
+            report(1, "ERROR: Merge failed (%d failures total)", fail_count);
+            ok = false;
+        }
+        show_queue(3);
+        return ok && !error_check();
+    }
+
+    /* Everything ends up in the first queue, which is selected */
+    list_for_each_entry (ctx, &chain, chain) {
+        ctx->size = 0;
+        ctx->sum = 0;
+    }
+    current = list_first_entry(&chain, queue_chain_t, chain);
+    current->size = total;
+    current->sum = sum;
+    record_select();
+
+    if (len != total) {
+        report(1, "ERROR: Merged %d elements, but the queues held %d", len,
+               total);
+        ok = false;
+    }
+
+    if (ok && total) {
+        q_iter_t it;
+        q_iter_init(&it, current->q, false);
+        element_t *item = q_iter_next(&it), *next_item;
+        int cnt = total;
+        while (--cnt > 0 && (next_item = q_iter_next(&it))) {
+            if (str_cmp(item->value, next_item->value) > 0) {
+                report(1, "ERROR: Not sorted in ascending order");
+                ok = false;
+                break;
+            }
+            item = next_item;
         }
     }
 
@@ -749,10 +1310,16 @@ typedef int
                                                       const struct list_head *,
                                                       const struct list_head *);
 
+/* Comparisons made by list_sort() through cmp_func(), see sortstat */
+static uint64_t list_sort_compares;
+
+/* Compare two elements, counting the comparison in *p unless p is NULL */
 int cmp_func(void *p, const struct list_head *a, const struct list_head *b)
 {
-    return strcmp(list_entry(a, element_t, list)->value,
-                  list_entry(b, element_t, list)->value);
+    if (p)
+        (*(uint64_t *) p)++;
+    return q_element_cmp(list_entry(a, element_t, list),
+                         list_entry(b, element_t, list));
 }
 
 __attribute__((nonnull(2, 3, 4))) static struct list_head *
@@ -907,6 +1474,31 @@ __attribute__((nonnull(2, 3))) void list_sort(void *priv,
     merge_final(priv, cmp, head, pending, list);
 }
 
+/* Fill st with the work of list_sort() on n elements */
+static void list_sort_stats(q_sort_stats_t *st, int n)
+{
+    memset(st, 0, sizeof(*st));
+    if (n < 2)
+        return;
+
+    /* Every element starts as a sublist, and each merge joins two of them */
+    st->compares = list_sort_compares;
+    st->runs = n;
+    st->merges = n - 1;
+
+    /*
+     * Replay how list_sort() keeps its pending sublists: unless count + 1 is
+     * a power of two, two of them are merged before adding the next element
+     */
+    size_t pending = 0;
+    for (size_t count = 0; count < (size_t) n; count++) {
+        if (count & (count + 1))
+            pending--;
+        if (++pending > st->max_pending)
+            st->max_pending = pending;
+    }
+}
+
 bool do_linux_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -914,25 +1506,37 @@ bool do_linux_sort(int argc, char *argv[])
         return false;
     }
 
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Calling sort no null queue");
     error_check();
 
-    int cnt = q_size(l_meta.l);
+    if (q_is_ring(current->q)) {
+        report(1, "ERROR: linux_sort needs a queue of linked nodes");
+        return false;
+    }
+
+    int cnt = q_size(current->q);
     if (cnt < 2)
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    record_op(BT_LINUX_SORT, 0);
     set_noallocate_mode(true);
-    if (exception_setup(true))
-        list_sort(NULL, l_meta.l, cmp_func);
+    list_sort_compares = 0;
+    sort_record_begin(&last_linux_sort, cnt);
+    if (exception_setup(true)) {
+        q_relink(current->q);
+        list_sort(&list_sort_compares, current->q, cmp_func);
+    }
     exception_cancel();
+    sort_record_end(&last_linux_sort);
+    list_sort_stats(&last_linux_sort.stats, cnt);
     set_noallocate_mode(false);
 
     bool ok = true;
-    if (l_meta.size) {
-        for (struct list_head *cur_l = l_meta.l->next;
-             cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
+    if (current->size) {
+        for (struct list_head *cur_l = current->q->next;
+             cur_l != current->q && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
             /* FIXME: add an option to specify sorting order */
             element_t *item, *next_item;
@@ -950,40 +1554,237 @@ bool do_linux_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Counters shown by sortstat, one per row */
+static const char *sortstat_rows[] = {
+    "elements",    "compares",     "runs",         "merges",
+    "max pending", "radix passes", "cache misses",
+};
+
+static long long sortstat_value(const sort_record_t *r, int row)
+{
+    switch (row) {
+    case 0:
+        return r->size;
+    case 1:
+        return r->stats.compares;
+    case 2:
+        return r->stats.runs;
+    case 3:
+        return r->stats.merges;
+    case 4:
+        return r->stats.max_pending;
+    case 5:
+        return r->stats.radix_passes;
+    default:
+        return r->misses;
+    }
+}
+
+/* Show the latest sort and linux_sort side by side, - for one not run yet */
+static void show_sortstat(void)
+{
+    const sort_record_t *r[2] = {&last_sort, &last_linux_sort};
+    char cell[2][32];
+
+    report(1, "%-14s %16s %16s", "", "q_sort", "list_sort");
+    for (int i = 0; i < 2; i++) {
+        if (r[i]->done)
+            snprintf(cell[i], sizeof(cell[i]), "%.3f", r[i]->msecs);
+        else
+            strcpy(cell[i], "-");
+    }
+    report(1, "%-14s %16s %16s", "time (ms)", cell[0], cell[1]);
+
+    for (int row = 0; row < (int) (sizeof(sortstat_rows) / sizeof(char *));
+         row++) {
+        for (int i = 0; i < 2; i++) {
+            long long v = sortstat_value(r[i], row);
+            if (!r[i]->done)
+                strcpy(cell[i], "-");
+            else if (v < 0)
+                strcpy(cell[i], "unavailable");
+            else
+                snprintf(cell[i], sizeof(cell[i]), "%lld", v);
+        }
+        report(1, "%-14s %16s %16s", sortstat_rows[row], cell[0], cell[1]);
+    }
+}
+
+/* Link the nodes of the list at head in the order of nodes[0..n) */
+static void relink_nodes(struct list_head *head,
+                         struct list_head **nodes,
+                         int n)
+{
+    struct list_head *prev = head;
+
+    for (int i = 0; i < n; i++) {
+        prev->next = nodes[i];
+        nodes[i]->prev = prev;
+        prev = nodes[i];
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/*
+ * Sort the current queue with q_sort, then put its nodes back in their order
+ * and sort them with list_sort. Both sorts thus work on the same input in the
+ * same memory, which the queue holds again at the end. Return false if they
+ * failed or disagreed.
+ */
+static bool sortstat_compare(void)
+{
+    if (!current->q) {
+        report(1, "No queue to sort");
+        return false;
+    }
+    if (q_is_ring(current->q)) {
+        report(1, "ERROR: list_sort needs a queue of linked nodes");
+        return false;
+    }
+
+    int n = q_size(current->q);
+    struct list_head **input = malloc(2 * (n + 1) * sizeof(*input));
+    if (!input) {
+        report(1, "ERROR: Could not allocate snapshot of queue");
+        return false;
+    }
+    struct list_head **sorted = input + n + 1, *node;
+    int i = 0;
+
+    q_relink(current->q);
+    list_for_each (node, current->q)
+        input[i++] = node;
+
+    if (!q_sort_reserve(n))
+        report(3, "Warning: Could not reserve sort scratch space");
+
+    bool ok = true;
+    sort_record_begin(&last_sort, n);
+    set_noallocate_mode(true);
+    if (exception_setup(true)) {
+        if (sort_threads > 1)
+            q_sort_parallel(current->q, sort_threads);
+        else
+            q_sort(current->q);
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+    set_noallocate_mode(false);
+    sort_record_end(&last_sort);
+    if (!sort_scratch)
+        q_sort_reserve(0);
+
+    i = 0;
+    if (ok) {
+        list_for_each (node, current->q)
+            sorted[i++] = node;
+    }
+    relink_nodes(current->q, input, n);
+
+    set_noallocate_mode(true);
+    list_sort_compares = 0;
+    sort_record_begin(&last_linux_sort, n);
+    if (ok && exception_setup(true))
+        list_sort(&list_sort_compares, current->q, cmp_func);
+    else
+        ok = false;
+    exception_cancel();
+    sort_record_end(&last_linux_sort);
+    list_sort_stats(&last_linux_sort.stats, n);
+    set_noallocate_mode(false);
+
+    /* Both sorts are stable, so they must leave the nodes in one order */
+    i = 0;
+    if (ok) {
+        list_for_each (node, current->q) {
+            if (node != sorted[i++]) {
+                report(1, "ERROR: q_sort and list_sort orders differ");
+                ok = false;
+                break;
+            }
+        }
+    }
+    relink_nodes(current->q, input, n);
+    free(input);
+
+    show_sortstat();
+    return ok;
+}
+
+static bool do_sortstat(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "compare"))
+        return sortstat_compare() && !error_check();
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments, or 'compare'", argv[0]);
+        return false;
+    }
+
+    show_sortstat();
+    return true;
+}
+
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_delete_mid, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Try to access null queue");
     error_check();
 
+    /* The middle is element size / 2, counting from 0 */
+    uint64_t mid = 0;
+    if (current->size) {
+        q_iter_t it;
+        q_iter_init(&it, current->q, false);
+        element_t *e = NULL;
+        for (int i = 0; i <= current->size / 2 && (e = q_iter_next(&it)); i++)
+            ;
+        mid = e ? value_hash(e->value) : 0;
+    }
+
     bool ok = true;
+    record_op(BT_DM, 0);
     if (exception_setup(true))
-        ok = q_delete_mid(l_meta.l);
+        ok = q_delete_mid(current->q);
     exception_cancel();
 
+    if (ok && current->size) {
+        current->sum -= mid;
+        current->size--;
+    }
+
     show_queue(3);
     return ok && !error_check();
 }
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_swap, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Try to access null queue");
     error_check();
 
+    record_op(BT_SWAP, 0);
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_swap(l_meta.l);
+        q_swap(current->q);
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -992,74 +1793,115 @@ static bool do_swap(int argc, char *argv[])
     return !error_check();
 }
 
-static bool is_circular()
+/* Check the links next to the head of the queue, in constant time */
+static bool ends_linked(int vlevel)
 {
-    struct list_head *cur = l_meta.l->next;
-    while (cur != l_meta.l) {
-        if (!cur)
-            return false;
-        cur = cur->next;
+    struct list_head *q = current->q;
+    if (!q_is_ring(q) && (q->next->prev != q || q->prev->next != q)) {
+        report(vlevel, "ERROR:  Queue is not doubly circular");
+        return false;
     }
 
-    cur = l_meta.l->prev;
-    while (cur != l_meta.l) {
-        if (!cur)
-            return false;
-        cur = cur->prev;
+    q_iter_t it;
+    q_iter_init(&it, q, false);
+    bool empty = !q_iter_next(&it);
+    if (empty && !q_iter_complete(&it)) {
+        report(vlevel, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+    if (empty != !current->size) {
+        report(vlevel, "ERROR:  Queue has %s elements than %d",
+               empty ? "fewer" : "more", current->size);
+        return false;
     }
     return true;
 }
 
-static bool show_queue(int vlevel)
-{
+/*
+ * Walk the whole queue both ways, checking that it holds size elements whose
+ * values add up to sum.
+ */
+static bool validate_queue(int vlevel)
+{
+    q_iter_t it;
+    int cnt = 0;
+    uint64_t sum = 0;
+
+    q_iter_init(&it, current->q, false);
+    for (element_t *e; cnt <= current->size && (e = q_iter_next(&it)); cnt++)
+        sum += value_hash(e->value);
+    if (cnt > current->size) {
+        report(vlevel, "ERROR:  Queue has more than %d elements",
+               current->size);
+        return false;
+    }
+
+    /* Walking back must meet the same elements, and get back to the head */
+    int back = 0;
+    if (q_iter_complete(&it)) {
+        q_iter_init(&it, current->q, true);
+        while (back <= cnt && q_iter_next(&it))
+            back++;
+    }
+    if (back != cnt || !q_iter_complete(&it)) {
+        report(vlevel, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    if (cnt < current->size) {
+        report(vlevel, "ERROR:  Queue has fewer than %d elements",
+               current->size);
+        return false;
+    }
+    if (sum != current->sum) {
+        report(vlevel, "ERROR:  Queue values differ from those inserted");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Print the start of the queue, after checking it. Small queues are walked
+ * entirely after every command, but large ones only every validate_period
+ * commands, and otherwise just have the links at their ends checked.
+ */
+static bool show_queue(int vlevel)
+{
     bool ok = true;
     if (verblevel < vlevel)
         return true;
 
     int cnt = 0;
-    if (!l_meta.l) {
+    if (!current->q) {
         report(vlevel, "l = NULL");
         return true;
     }
 
-    if (!is_circular()) {
-        report(vlevel, "ERROR:  Queue is not doubly circular");
+    bool full = current->size <= VALIDATE_SMALL || validate_period == 1 ||
+                (validate_period > 0 && ++validate_skipped >= validate_period);
+    if (full)
+        validate_skipped = 0;
+    if (!ends_linked(vlevel) || (full && !validate_queue(vlevel)))
         return false;
-    }
 
     report_noreturn(vlevel, "l = [");
 
-    struct list_head *ori = l_meta.l;
-    struct list_head *cur = l_meta.l->next;
+    q_iter_t it;
+    bool more = false;
+    q_iter_init(&it, current->q, false);
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < lcnt) {
-            element_t *e = list_entry(cur, element_t, list);
-            if (cnt < big_list_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+        element_t *e;
+        while (ok && cnt < big_list_size && (e = q_iter_next(&it))) {
+            report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
             cnt++;
-            cur = cur->next;
             ok = ok && !error_check();
         }
+        more = ok && cnt == big_list_size && q_iter_next(&it);
     }
     exception_cancel();
 
-    if (!ok) {
-        report(vlevel, " ... ]");
-        return false;
-    }
-
-    if (cur == ori) {
-        if (cnt <= big_list_size)
-            report(vlevel, "]");
-        else
-            report(vlevel, " ... ]");
-    } else {
-        report(vlevel, " ... ]");
-        report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
-        ok = false;
-    }
-
+    report(vlevel, !ok || more ? " ... ]" : "]");
     return ok;
 }
 
@@ -1072,49 +1914,105 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
-bool q_shuffle(struct list_head *head, int cnt)
+/* xorshift64* generator, seeded from rand() so that srand() still rules */
+static uint64_t shuffle_rand(void)
 {
-    if (!head || list_empty(head))
-        return false;
+    static uint64_t state = 0;
+
+    if (!state)
+        state = ((uint64_t) rand() << 32 | (uint64_t) rand()) | 1;
 
-    for (struct list_head *result = head->prev; --cnt; result = result->prev) {
-        int target = rand() % (cnt + 1);
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Shuffle the cnt nodes of queue with Fisher-Yates on an array of node
+ * pointers, then relink them. Nodes are only shuffled inside consecutive
+ * windows of window nodes, so a small window keeps each node close to where
+ * it was. Nodes are moved rather than values, since an inline string belongs
+ * to the block of its element.
+ */
+bool q_shuffle(struct list_head *head, int cnt, int window)
+{
+    if (!head || list_empty(head) || window < 1)
+        return false;
 
-        struct list_head *scratch = head->next;
+    /* Windows are counted from the head of the queue */
+    q_relink(head);
+    struct list_head **nodes = malloc(sizeof(*nodes) * cnt);
+    if (!nodes)
+        return false;
 
-        for (int i = 0; i < target; i++)
-            scratch = scratch->next;
+    int n = 0;
+    struct list_head *node;
+    list_for_each (node, head) {
+        if (n == cnt)
+            break;
+        nodes[n++] = node;
+    }
+    /* Nodes beyond cnt, if any, keep their place after the shuffled ones */
+    struct list_head *rest = node;
+
+    for (int start = 0; start < n; start += window) {
+        struct list_head **w = nodes + start;
+        int len = n - start < window ? n - start : window;
+
+        for (int i = len - 1; i > 0; i--) {
+            int k = ((shuffle_rand() >> 32) * (uint64_t) (i + 1)) >> 32;
+            node = w[i];
+            w[i] = w[k];
+            w[k] = node;
+        }
+    }
 
-        element_t *r = list_entry(result, element_t, list);
-        element_t *s = list_entry(scratch, element_t, list);
-        char *tmp = r->value;
-        r->value = s->value;
-        s->value = tmp;
+    struct list_head *prev = head;
+    for (int i = 0; i < n; i++) {
+        prev->next = nodes[i];
+        nodes[i]->prev = prev;
+        prev = nodes[i];
     }
+    prev->next = rest;
+    rest->prev = prev;
 
+    free(nodes);
     return true;
 }
 
 static bool do_shuffle(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l)
+    if (!current->q)
         report(3, "Warning: Calling shuffle on null queue");
     error_check();
 
-    int cnt = q_size(l_meta.l);
+    if (q_is_ring(current->q)) {
+        report(1, "ERROR: shuffle needs a queue of linked nodes");
+        return false;
+    }
+
+    int cnt = q_size(current->q);
     if (cnt < 2)
         report(3, "Warning: Calling shuffle on single node");
     error_check();
 
+    int window = cnt;
+    if (argc == 2 && (!get_int(argv[1], &window) || window < 1)) {
+        report(1, "Invalid shuffle window '%s'", argv[1]);
+        return false;
+    }
+
     bool ok = false;
+    record_op(BT_SHUFFLE, 1, window);
     set_noallocate_mode(true);
     if (exception_setup(true))
-        ok = q_shuffle(l_meta.l, cnt);
+        ok = q_shuffle(current->q, cnt, window);
     exception_cancel();
     set_noallocate_mode(false);
     show_queue(3);
@@ -1122,11 +2020,769 @@ static bool do_shuffle(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Return nanoseconds per element of a walk that reads every string of q */
+static double traversal_time(struct list_head *q)
+{
+    int n = q_size(q);
+    if (!n)
+        return 0;
+
+    struct timespec start, end;
+    q_iter_t it;
+    unsigned char sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    q_iter_init(&it, q, false);
+    for (element_t *e; (e = q_iter_next(&it));)
+        sum += *e->value;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* Keep the reads from being optimized away */
+    volatile unsigned char sink = sum;
+    (void) sink;
+    return ((end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec)) /
+           n;
+}
+
+static bool do_compact(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current->q)
+        report(3, "Warning: Calling compact on null queue");
+    error_check();
+
+    double before = current->q ? traversal_time(current->q) : 0;
+    bool ok = false;
+    record_op(BT_COMPACT, 0);
+    if (exception_setup(true))
+        ok = q_compact(current->q);
+    exception_cancel();
+
+    if (!ok && current->q) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Compacting queue failed");
+            ok = true;
+        } else {
+            report(1, "ERROR: Compacting queue failed (%d failures total)",
+                   fail_count);
+        }
+    }
+    if (current->q)
+        report(2, "Traversal: %.1f ns per element before, %.1f ns after",
+               before, traversal_time(current->q));
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static void lat_report(const char *op, const lat_hist_t *h)
+{
+    report(1, "%s latency (cycles): p50 %" PRIu64 ", p90 %" PRIu64
+              ", p99 %" PRIu64 ", max %" PRIu64,
+           op, lat_quantile(h, 500), lat_quantile(h, 900),
+           lat_quantile(h, 990), h->max);
+}
+
+/* Slots in the concurrent queue used by stress */
+#define STRESS_CAPACITY 1024
+
+/* State shared by the threads of stress */
+static struct {
+    q_mpmc_t *q;
+    int producers;
+    int per_producer;
+    atomic_size_t consumed;
+    atomic_bool abort;
+    /* One flag per element, to find duplicates across consumers */
+    atomic_uchar *seen;
+} stress;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    lat_hist_t hist;
+    size_t ops;
+    size_t retries;
+    size_t errors;
+} stress_worker_t;
+
+static void *stress_producer(void *arg)
+{
+    stress_worker_t *w = arg;
+    char buf[32];
+
+    for (int seq = 0; seq < stress.per_producer; seq++) {
+        snprintf(buf, sizeof(buf), "%d:%d", w->id, seq);
+        for (;;) {
+            int64_t before = cpucycles();
+            bool ok = q_mpmc_insert_tail(stress.q, buf);
+            int64_t after = cpucycles();
+            if (ok) {
+                lat_record(&w->hist, after - before);
+                break;
+            }
+            /* Full, or the allocation failed */
+            if (atomic_load(&stress.abort))
+                return NULL;
+            w->retries++;
+            sched_yield();
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+static void *stress_consumer(void *arg)
+{
+    stress_worker_t *w = arg;
+    size_t total = (size_t) stress.producers * stress.per_producer;
+    int *last = malloc(stress.producers * sizeof(int));
+    if (!last) {
+        w->errors++;
+        atomic_store(&stress.abort, true);
+        return NULL;
+    }
+    for (int i = 0; i < stress.producers; i++)
+        last[i] = -1;
+
+    while (atomic_load_explicit(&stress.consumed, memory_order_relaxed) <
+           total) {
+        if (atomic_load(&stress.abort))
+            break;
+        int64_t before = cpucycles();
+        element_t *e = q_mpmc_remove_head(stress.q, NULL, 0);
+        int64_t after = cpucycles();
+        if (!e) {
+            w->retries++;
+            sched_yield();
+            continue;
+        }
+        lat_record(&w->hist, after - before);
+
+        /*
+         * Positions are claimed in increasing order, so one consumer sees the
+         * elements of each producer in the order they were inserted.
+         */
+        int id, seq;
+        if (sscanf(e->value, "%d:%d", &id, &seq) != 2 || id < 0 ||
+            id >= stress.producers || seq <= last[id] ||
+            seq >= stress.per_producer ||
+            atomic_exchange(&stress.seen[(size_t) id * stress.per_producer +
+                                         seq],
+                            1)) {
+            w->errors++;
+        } else {
+            last[id] = seq;
+        }
+        q_release_element(e);
+        w->ops++;
+        atomic_fetch_add_explicit(&stress.consumed, 1, memory_order_relaxed);
+    }
+
+    free(last);
+    return NULL;
+}
+
+static bool do_stress(int argc, char *argv[])
+{
+    int producers, consumers, n;
+    if (argc != 4 || !get_int(argv[1], &producers) || producers < 1 ||
+        !get_int(argv[2], &consumers) || consumers < 1 ||
+        !get_int(argv[3], &n) || n < 1) {
+        report(1, "%s needs positive numbers of producers, consumers and "
+                  "elements per producer", argv[0]);
+        return false;
+    }
+
+    if (alloc_mode == Q_ALLOC_POOL || alloc_mode == Q_ALLOC_INTERN) {
+        report(1, "ERROR: stress cannot share element pools or interned "
+                  "strings between threads");
+        return false;
+    }
+
+    size_t total = (size_t) producers * n;
+    stress.seen = calloc(total, sizeof(*stress.seen));
+    int nworkers = producers + consumers;
+    stress_worker_t *workers = calloc(nworkers, sizeof(*workers));
+    if (!stress.seen || !workers) {
+        report(1, "ERROR: Could not allocate stress state");
+        free(stress.seen);
+        free(workers);
+        return false;
+    }
+
+    error_check();
+    size_t bcnt = allocation_check();
+    bool ok = true;
+
+    stress.q = q_mpmc_new(STRESS_CAPACITY);
+    if (!stress.q) {
+        /* Like a failed insertion, since malloc may be set to fail */
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Could not create concurrent queue");
+        } else {
+            report(1,
+                   "ERROR: Could not create concurrent queue (%d failures "
+                   "total)",
+                   fail_count);
+            ok = false;
+        }
+        free(stress.seen);
+        free(workers);
+        return ok && !error_check();
+    }
+    stress.producers = producers;
+    stress.per_producer = n;
+    atomic_store(&stress.consumed, 0);
+    atomic_store(&stress.abort, false);
+
+    /* Only this thread may take the time limit signal and jump back */
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    set_thread_safe_mode(true);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int started = 0;
+    for (; started < nworkers; started++) {
+        stress_worker_t *w = &workers[started];
+        bool producer = started < producers;
+        w->id = producer ? started : started - producers;
+        if (pthread_create(&w->thread, NULL,
+                           producer ? stress_producer : stress_consumer, w)) {
+            report(1, "ERROR: Could not start thread %d", started);
+            atomic_store(&stress.abort, true);
+            ok = false;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    set_thread_safe_mode(false);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    lat_hist_t inserts = {0}, removes = {0};
+    size_t inserted = 0, removed = 0, retries = 0, errors = 0;
+    for (int i = 0; i < started; i++) {
+        stress_worker_t *w = &workers[i];
+        if (i < producers) {
+            lat_merge(&inserts, &w->hist);
+            inserted += w->ops;
+        } else {
+            lat_merge(&removes, &w->hist);
+            removed += w->ops;
+        }
+        retries += w->retries;
+        errors += w->errors;
+    }
+
+    q_mpmc_free(stress.q);
+    stress.q = NULL;
+    free(stress.seen);
+    stress.seen = NULL;
+    free(workers);
+
+    if (ok && (inserted != total || removed != total)) {
+        report(1, "ERROR: Inserted %zu and removed %zu of %zu elements",
+               inserted, removed, total);
+        ok = false;
+    }
+    if (errors) {
+        report(1, "ERROR: %zu elements were lost, duplicated or out of order",
+               errors);
+        ok = false;
+    }
+    if (allocation_check() != bcnt) {
+        report(1, "ERROR: %zu blocks still allocated after stress",
+               allocation_check() - bcnt);
+        ok = false;
+    }
+
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    report(1, "%zu inserts and %zu removes in %.3f s, %.0f ops/sec",
+           inserted, removed, secs, (inserted + removed) / secs);
+    report(2, "%zu attempts retried on full or empty queue", retries);
+    lat_report("Insert", &inserts);
+    lat_report("Remove", &removes);
+
+    return ok && !error_check();
+}
+
+/* Smallest queue timed by bench, then growing BENCH_STEP times each step */
+#define BENCH_MIN 1024
+#define BENCH_STEP 4
+#define BENCH_SIZES 12
+
+/* Calls timed for operations that should not depend on the queue size */
+#define BENCH_CALLS 1024
+
+/* Elements visited per size by operations that walk the whole queue */
+#define BENCH_WORK (1 << 20)
+
+/* Times each size below BENCH_WORK is timed, keeping the fastest */
+#define BENCH_TRIALS 3
+
+/* How much faster than expected the time per call may grow */
+#define BENCH_SLACK 0.5
+
+/* Largest queue timed by bench */
+static int bench_max = 1 << 22;
+
+/* Strings the timed queues are built from */
+static char bench_buf[RAND_BATCH][MAX_RANDSTR_LEN];
+static char *bench_strs[RAND_BATCH];
+
+/* Reference for the cost of visiting every element, see bench_fit() */
+static void bench_walk(struct list_head *q, int calls)
+{
+    volatile int n;
+    for (int i = 0; i < calls; i++) {
+        int cnt = 0;
+        struct list_head *node;
+        list_for_each (node, q)
+            cnt++;
+        n = cnt;
+    }
+    (void) n;
+}
+
+static void bench_insert_head(struct list_head *q, int calls)
+{
+    for (int i = 0; i < calls; i++)
+        q_insert_head(q, bench_strs[i % RAND_BATCH]);
+}
+
+static void bench_insert_tail(struct list_head *q, int calls)
+{
+    for (int i = 0; i < calls; i++)
+        q_insert_tail(q, bench_strs[i % RAND_BATCH]);
+}
+
+static void bench_remove_head(struct list_head *q, int calls)
+{
+    for (int i = 0; i < calls; i++)
+        q_release_element(q_remove_head(q, NULL, 0));
+}
+
+static void bench_remove_tail(struct list_head *q, int calls)
+{
+    for (int i = 0; i < calls; i++)
+        q_release_element(q_remove_tail(q, NULL, 0));
+}
+
+static void bench_size(struct list_head *q, int calls)
+{
+    /* Keep the calls from being merged */
+    volatile int n;
+    for (int i = 0; i < calls; i++)
+        n = q_size(q);
+    (void) n;
+}
+
+static void bench_reverse(struct list_head *q, int calls)
+{
+    for (int i = 0; i < calls; i++)
+        q_reverse(q);
+}
+
+static void bench_swap(struct list_head *q, int calls)
+{
+    for (int i = 0; i < calls; i++)
+        q_swap(q);
+}
+
+static void bench_dm(struct list_head *q, int calls)
+{
+    for (int i = 0; i < calls; i++)
+        q_delete_mid(q);
+}
+
+static void bench_shuffle(struct list_head *q, int calls)
+{
+    int cnt = q_size(q);
+    for (int i = 0; i < calls; i++)
+        q_shuffle(q, cnt, cnt);
+}
+
+static void bench_sort(struct list_head *q, int calls)
+{
+    q_sort_reserve(q_size(q));
+    q_sort(q);
+}
+
+static void bench_free(struct list_head *q, int calls)
+{
+    q_free(q);
+}
+
+/*
+ * Operations timed by bench. exponent is how the time per call is expected
+ * to grow with the queue size n, as n^exponent. calls is how many calls are
+ * timed on each queue: 0 makes it BENCH_WORK / n, at least 1. An operation
+ * that consumes frees the queue itself.
+ */
+static const struct {
+    const char *name;
+    double exponent;
+    int calls;
+    bool consumes;
+    void (*run)(struct list_head *q, int calls);
+} bench_ops[] = {
+    {"walk", 1, 0, false, bench_walk},
+    {"insert_head", 0, BENCH_CALLS, false, bench_insert_head},
+    {"insert_tail", 0, BENCH_CALLS, false, bench_insert_tail},
+    {"remove_head", 0, BENCH_CALLS, false, bench_remove_head},
+    {"remove_tail", 0, BENCH_CALLS, false, bench_remove_tail},
+    {"size", 0, BENCH_CALLS, false, bench_size},
+    {"reverse", 0, BENCH_CALLS, false, bench_reverse},
+    {"swap", 1, 0, false, bench_swap},
+    {"dm", 1, 0, false, bench_dm},
+    {"shuffle", 1, 0, false, bench_shuffle},
+    {"sort", 1, 1, false, bench_sort},
+    {"free", 1, 1, true, bench_free},
+};
+
+#define BENCH_OPS (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+/* Time per call of each operation at each size */
+typedef struct {
+    int nsizes;
+    int sizes[BENCH_SIZES];
+    double ns[BENCH_OPS][BENCH_SIZES];
+    double cycles[BENCH_OPS][BENCH_SIZES];
+    double slope[BENCH_OPS];
+} bench_result_t;
+
+/*
+ * Time calls of operation op on a new queue of n elements. Return false if
+ * the queue could not be built, or the calls hit the time limit or crashed.
+ */
+static bool bench_time(size_t op, int n, double *ns, double *cycles)
+{
+    struct list_head *q = q_new();
+    if (!q || q_insert_tail_bulk(q, bench_strs, RAND_BATCH, n) != n) {
+        q_free(q);
+        report(1, "ERROR: Could not build a queue of %d elements", n);
+        return false;
+    }
+
+    int calls = bench_ops[op].calls;
+    if (!calls)
+        calls = n < BENCH_WORK ? BENCH_WORK / n : 1;
+
+    struct timespec start = {0}, end = {0};
+    int64_t before = 0, after = 0;
+    if (exception_setup(true)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        before = cpucycles();
+        bench_ops[op].run(q, calls);
+        after = cpucycles();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    exception_cancel();
+
+    /* The queue may be left inconsistent, so it is not freed */
+    if (error_check()) {
+        report(1, "ERROR: %s failed on a queue of %d elements",
+               bench_ops[op].name, n);
+        return false;
+    }
+
+    if (!bench_ops[op].consumes)
+        q_free(q);
+
+    *ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+          calls;
+    *cycles = (double) (after - before) / calls;
+    return true;
+}
+
+/* Least squares slope of log(ns) against log(size) */
+static double bench_slope(const bench_result_t *r, size_t op)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int n = 0;
+    for (int i = 0; i < r->nsizes; i++) {
+        if (r->ns[op][i] <= 0)
+            continue;
+        double x = log(r->sizes[i]), y = log(r->ns[op][i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        n++;
+    }
+    double den = n * sxx - sx * sx;
+    return n > 1 && den > 0 ? (n * sxy - sx * sy) / den : 0;
+}
+
+/*
+ * Return the growth exponent of operation op. Once a queue outgrows the
+ * caches, each element visited costs a cache miss, so on its own the slope
+ * of a linear operation comes out well above 1. The excess of the walk
+ * reference over 1 is taken out as many times as the operation is expected
+ * to visit the queue.
+ */
+static double bench_fit(const bench_result_t *r, size_t op)
+{
+    double walk = bench_slope(r, 0) - 1;
+    return bench_slope(r, op) - bench_ops[op].exponent * walk;
+}
+
+static bool bench_flagged(const bench_result_t *r, size_t op)
+{
+    return r->slope[op] > bench_ops[op].exponent + BENCH_SLACK;
+}
+
+/* Write r to file_name, as JSON if the name ends in .json, otherwise CSV */
+static bool bench_write(const bench_result_t *r, const char *file_name)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f)
+        return false;
+
+    size_t len = strlen(file_name);
+    if (len >= 5 && !strcmp(file_name + len - 5, ".json")) {
+        fprintf(f, "{\"sizes\": [");
+        for (int i = 0; i < r->nsizes; i++)
+            fprintf(f, "%s%d", i ? ", " : "", r->sizes[i]);
+        fprintf(f, "],\n \"ops\": {");
+        for (size_t op = 0; op < BENCH_OPS; op++) {
+            fprintf(f, "%s\n  \"%s\": {\"ns\": [", op ? "," : "",
+                    bench_ops[op].name);
+            for (int i = 0; i < r->nsizes; i++)
+                fprintf(f, "%s%.1f", i ? ", " : "", r->ns[op][i]);
+            fprintf(f, "], \"cycles\": [");
+            for (int i = 0; i < r->nsizes; i++)
+                fprintf(f, "%s%.1f", i ? ", " : "", r->cycles[op][i]);
+            fprintf(f,
+                    "], \"slope\": %.3f, \"exponent\": %.3f, "
+                    "\"expected\": %.0f, \"flagged\": %s}",
+                    bench_slope(r, op), r->slope[op], bench_ops[op].exponent,
+                    bench_flagged(r, op) ? "true" : "false");
+        }
+        fprintf(f, "\n}}\n");
+    } else {
+        fprintf(f, "op,size,ns_per_call,cycles_per_call\n");
+        for (size_t op = 0; op < BENCH_OPS; op++) {
+            for (int i = 0; i < r->nsizes; i++)
+                fprintf(f, "%s,%d,%.1f,%.1f\n", bench_ops[op].name,
+                        r->sizes[i], r->ns[op][i], r->cycles[op][i]);
+        }
+    }
+
+    return !fclose(f);
+}
+
+/* A growth exponent needs at least two sizes to be fitted */
+static void bench_max_changed(int oldval)
+{
+    if (bench_max < BENCH_MIN * BENCH_STEP) {
+        report(1, "bench needs benchmax of at least %d",
+               BENCH_MIN * BENCH_STEP);
+        bench_max = oldval;
+    }
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    for (int i = 0; i < RAND_BATCH; i++) {
+        fill_rand_string(bench_buf[i], sizeof(bench_buf[i]));
+        bench_strs[i] = bench_buf[i];
+    }
+
+    bench_result_t *r = calloc(1, sizeof(*r));
+    if (!r) {
+        report(1, "ERROR: Could not allocate benchmark results");
+        return false;
+    }
+    for (long n = BENCH_MIN; n <= bench_max && r->nsizes < BENCH_SIZES;
+         n *= BENCH_STEP)
+        r->sizes[r->nsizes++] = n;
+
+    /* Injected failures would only spoil the timings */
+    int saved_fail_probability = fail_probability;
+    fail_probability = 0;
+    error_check();
+
+    bool ok = true;
+    for (size_t op = 0; op < BENCH_OPS && ok; op++) {
+        for (int i = 0; i < r->nsizes && ok; i++) {
+            int n = r->sizes[i];
+            int trials = n < BENCH_WORK ? BENCH_TRIALS : 1;
+            for (int k = 0; k < trials; k++) {
+                double ns, cycles;
+                if (!bench_time(op, n, &ns, &cycles)) {
+                    ok = false;
+                    break;
+                }
+                if (!k || ns < r->ns[op][i]) {
+                    r->ns[op][i] = ns;
+                    r->cycles[op][i] = cycles;
+                }
+            }
+            if (!ok)
+                break;
+            report(2, "%-12s %10d elements %12.1f ns/call %14.1f cycles/call",
+                   bench_ops[op].name, r->sizes[i], r->ns[op][i],
+                   r->cycles[op][i]);
+        }
+        r->slope[op] = bench_fit(r, op);
+    }
+    fail_probability = saved_fail_probability;
+
+    if (ok) {
+        report(1, "%-12s %12s %12s %9s %9s", "Operation", "ns/call", "",
+               "growth", "expected");
+        report(1, "%-12s %12d %12d", "", r->sizes[0], r->sizes[r->nsizes - 1]);
+        for (size_t op = 0; op < BENCH_OPS; op++) {
+            bool flagged = bench_flagged(r, op);
+            report(1, "%-12s %12.1f %12.1f %9.2f %9.0f%s", bench_ops[op].name,
+                   r->ns[op][0], r->ns[op][r->nsizes - 1], r->slope[op],
+                   bench_ops[op].exponent,
+                   flagged ? "  ERROR: grows faster than expected" : "");
+        }
+    }
+
+    if (ok && argc == 2 && !bench_write(r, argv[1])) {
+        report(1, "ERROR: Could not write benchmark results to '%s'",
+               argv[1]);
+        ok = false;
+    }
+    for (size_t op = 0; op < BENCH_OPS && ok; op++)
+        ok = !bench_flagged(r, op);
+    free(r);
+
+    return ok && !error_check();
+}
+
+/* Order call sites by decreasing bytes allocated */
+static int cmp_site(const void *a, const void *b)
+{
+    const mem_site_t *sa = a, *sb = b;
+    if (sa->bytes != sb->bytes)
+        return sa->bytes < sb->bytes ? 1 : -1;
+    return sa->allocs < sb->allocs ? 1 : sa->allocs > sb->allocs ? -1 : 0;
+}
+
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        mem_stats_reset();
+        return true;
+    }
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments, or 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!mem_profiling)
+        report(1, "Warning: profiling is off, use 'option memprof 1'");
+
+    mem_stats_t st;
+    mem_stats(&st);
+    report(1, "Allocations: %zu, frees: %zu, live blocks: %zu", st.allocs,
+           st.frees, allocation_check());
+    report(1, "Bytes allocated: %zu, freed: %zu, live: %zu, peak live: %zu",
+           st.bytes, st.freed_bytes, st.live_bytes, st.peak_bytes);
+
+    report(1, "Allocations by size (bytes):");
+    for (int c = 0; c < MEM_CLASSES; c++) {
+        if (!st.classes[c])
+            continue;
+        size_t lo = c ? ((size_t) 1 << (c - 1)) + 1 : 0;
+        if (c == MEM_CLASSES - 1)
+            report(1, "  %10zu and up    %12zu", lo, st.classes[c]);
+        else
+            report(1, "  %10zu - %-10zu %12zu", lo, (size_t) 1 << c,
+                   st.classes[c]);
+    }
+
+    mem_site_t *sites = malloc(MEM_SITES * sizeof(mem_site_t));
+    if (!sites) {
+        report(1, "ERROR: Could not allocate call site list");
+        return false;
+    }
+    size_t n = mem_sites(sites, MEM_SITES);
+    qsort(sites, n, sizeof(mem_site_t), cmp_site);
+    if (n > MEMSTAT_SITES)
+        n = MEMSTAT_SITES;
+
+    /* Return addresses point past the call, so look up the byte before */
+    void *addrs[MEMSTAT_SITES];
+    for (size_t i = 0; i < n; i++)
+        addrs[i] = sites[i].site ? (char *) sites[i].site - 1 : NULL;
+    char **names = n ? backtrace_symbols(addrs, n) : NULL;
+
+    report(1, "%10s %12s %10s %12s  %s", "allocs", "bytes", "frees",
+           "live bytes", "call site");
+    for (size_t i = 0; i < n; i++) {
+        const mem_site_t *site = &sites[i];
+        const char *name = !site->site ? "(other sites)"
+                           : names     ? names[i]
+                                       : "?";
+        report(1, "%10zu %12zu %10zu %12zu  %s", site->allocs, site->bytes,
+               site->frees, site->live_bytes, name);
+    }
+
+    free(names);
+    free(sites);
+    return true;
+}
+
+static void sort_scratch_changed(int oldval)
+{
+    if (!sort_scratch)
+        q_sort_reserve(0);
+}
+
+static void mem_profiling_changed(int oldval)
+{
+    set_profile_mode(mem_profiling);
+}
+
+static void alloc_mode_changed(int oldval)
+{
+    if (!q_set_alloc_mode(alloc_mode)) {
+        report(1, "Unknown allocation mode, or elements are still allocated");
+        alloc_mode = oldval;
+    } else {
+        record_op(BT_ALLOC, 1, alloc_mode);
+    }
+}
+
 static void console_init()
 {
-    ADD_COMMAND(new, "                | Create new queue");
-    ADD_COMMAND(free, "                | Delete queue");
-    ADD_COMMAND(shuffle, "                | Shuffle nodes in queue");
+    ADD_COMMAND(new,
+                " [ring]         | Create and select new queue, held in a "
+                "ring buffer if ring is given");
+    ADD_COMMAND(free,
+                "                | Delete queue, and select the one created "
+                "before it");
+    ADD_COMMAND(prev, "                | Select previous queue");
+    ADD_COMMAND(next, "                | Select next queue");
+    ADD_COMMAND(select, " id             | Select queue with given id");
+    ADD_COMMAND(shuffle,
+                " [n]            | Shuffle nodes in queue, only within "
+                "consecutive windows of n nodes if given");
     ADD_COMMAND(
         ih,
         " str [n]        | Insert string str at head of queue n times. "
@@ -1146,9 +2802,16 @@ static void console_init()
     ADD_COMMAND(
         rhq,
         "                | Remove from head of queue without reporting value.");
+    ADD_COMMAND(
+        rhn, " n              | Remove n elements from head of queue at once");
+    ADD_COMMAND(
+        rtn, " n              | Remove n elements from tail of queue at once");
     ADD_COMMAND(reverse, "                | Reverse queue");
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
     ADD_COMMAND(linux_sort, "        | (Linux)Sort queue in ascending order");
+    ADD_COMMAND(merge,
+                "                | Merge all sorted queues into the first "
+                "one, and select it");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
     ADD_COMMAND(show, "                | Show queue contents");
@@ -1157,12 +2820,47 @@ static void console_init()
         dedup, "                | Delete all nodes that have duplicate string");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
+    ADD_COMMAND(stress,
+                " P C N          | Run P producer and C consumer threads on a "
+                "concurrent queue, N elements per producer");
+    ADD_COMMAND(compact,
+                "                | Reallocate elements in queue order for "
+                "locality");
+    ADD_COMMAND(bench,
+                " [file]         | Time queue operations at growing sizes, "
+                "writing CSV or JSON to file");
+    ADD_COMMAND(memstat,
+                " [reset]        | Show allocation profile, or clear it");
+    ADD_COMMAND(sortstat,
+                " [compare]      | Show work of latest sorts, or compare "
+                "q_sort and list_sort on queue, leaving it unchanged");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("alloc", &alloc_mode,
+              "Element allocation (0: malloc, 1: pool, 2: inline, 3: intern)",
+              alloc_mode_changed);
+    add_param("threads", &sort_threads, "Number of threads used by sort",
+              NULL);
+    add_param("zerocopy", &zero_copy,
+              "Remove without copying when rh/rt gets no value (0: off, 1: on)",
+              NULL);
+    add_param("hashdedup", &hash_dedup,
+              "Dedup unsorted queue by hashing (0: off, 1: on)", NULL);
+    add_param("benchmax", &bench_max, "Largest queue timed by bench",
+              bench_max_changed);
+    add_param("validate", &validate_period,
+              "Commands between full checks of a large queue (0: never)",
+              NULL);
+    add_param("sortscratch", &sort_scratch,
+              "Keep sort scratch space between sorts (0: off, 1: on)",
+              sort_scratch_changed);
+    add_param("memprof", &mem_profiling,
+              "Profile allocations for memstat (0: off, 1: on)",
+              mem_profiling_changed);
 }
 
 /* Signal handlers */
@@ -1185,7 +2883,7 @@ static void sigalrmhandler(int sig)
 static void queue_init()
 {
     fail_count = 0;
-    l_meta.l = NULL;
+    current = &no_queue;
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
 }
@@ -1193,13 +2891,17 @@ static void queue_init()
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
 
-    if (exception_setup(true))
-        q_free(l_meta.l);
-    exception_cancel();
-    set_cautious_mode(true);
+    queue_chain_t *ctx, *safe;
+    list_for_each_entry_safe (ctx, safe, &chain, chain) {
+        if (exception_setup(true))
+            q_free(ctx->q);
+        exception_cancel();
+        list_del(&ctx->chain);
+        free(ctx);
+    }
+    chain_size = 0;
+    current = &no_queue;
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1211,13 +2913,208 @@ static bool queue_quit(int argc, char *argv[])
     return true;
 }
 
+/* Execute the records of a loaded binary trace, counting them in *nops */
+static bool replay_ops(bt_reader_t *r, size_t *nops)
+{
+    char *buf = NULL;
+    size_t bufsize = 0;
+    char *strs[RAND_BATCH];
+    int op;
+
+    while ((op = bt_get_op(r)) >= 0) {
+        struct list_head *q = current->q;
+        (*nops)++;
+
+        switch (op) {
+        case BT_NEW: {
+            int ring = bt_get_int(r);
+            queue_chain_t *ctx = malloc(sizeof(queue_chain_t));
+            if (!ctx)
+                return false;
+            ctx->q = ring ? q_new_ring() : q_new();
+            ctx->size = 0;
+            ctx->sum = 0;
+            ctx->id = next_id++;
+            list_add_tail(&ctx->chain, &chain);
+            chain_size++;
+            current = ctx;
+            break;
+        }
+        case BT_FREE:
+            q_free(q);
+            if (current != &no_queue) {
+                list_del(&current->chain);
+                free(current);
+                chain_size--;
+                current = &no_queue;
+            }
+            break;
+        case BT_SELECT: {
+            int id = bt_get_int(r);
+            queue_chain_t *ctx;
+            current = &no_queue;
+            list_for_each_entry (ctx, &chain, chain) {
+                if (ctx->id == id) {
+                    current = ctx;
+                    break;
+                }
+            }
+            break;
+        }
+        case BT_ALLOC:
+            alloc_mode = bt_get_int(r);
+            q_set_alloc_mode(alloc_mode);
+            break;
+        case BT_INSERT: {
+            int tail = bt_get_int(r), n = bt_get_int(r), cnt = bt_get_int(r);
+            if (cnt < 1 || cnt > RAND_BATCH || n < cnt)
+                return false;
+            for (int i = 0; i < cnt; i++)
+                strs[i] = (char *) bt_get_str(r);
+            if (r->bad)
+                return false;
+            if (tail)
+                q_insert_tail_bulk(q, strs, cnt, n);
+            else
+                q_insert_head_bulk(q, strs, cnt, n);
+            break;
+        }
+        case BT_REMOVE: {
+            int tail = bt_get_int(r), size = bt_get_int(r);
+            element_t *e;
+            if (size < 0) {
+                const char *value;
+                e = tail ? q_remove_tail_ref(q, &value, NULL)
+                         : q_remove_head_ref(q, &value, NULL);
+            } else {
+                if ((size_t) size > bufsize) {
+                    free(buf);
+                    bufsize = size;
+                    if (!(buf = malloc(bufsize)))
+                        return false;
+                }
+                e = tail ? q_remove_tail(q, size ? buf : NULL, size)
+                         : q_remove_head(q, size ? buf : NULL, size);
+            }
+            if (e)
+                q_release_element(e);
+            break;
+        }
+        case BT_REMOVE_RANGE: {
+            LIST_HEAD(drained);
+            element_t *e, *safe;
+            q_remove_range(q, bt_get_int(r), &drained);
+            list_for_each_entry_safe (e, safe, &drained, list)
+                q_release_element(e);
+            break;
+        }
+        case BT_REVERSE:
+            q_reverse(q);
+            break;
+        case BT_SORT: {
+            int threads = bt_get_int(r);
+            q_sort_reserve(q_size(q));
+            if (threads > 1)
+                q_sort_parallel(q, threads);
+            else
+                q_sort(q);
+            break;
+        }
+        case BT_LINUX_SORT:
+            if (q && !q_is_ring(q)) {
+                q_relink(q);
+                list_sort(NULL, q, cmp_func);
+            }
+            break;
+        case BT_SIZE:
+            for (int n = bt_get_int(r); n > 0; n--)
+                q_size(q);
+            break;
+        case BT_DM:
+            q_delete_mid(q);
+            break;
+        case BT_DEDUP:
+            if (bt_get_int(r))
+                q_delete_dup_unsorted(q);
+            else
+                q_delete_dup(q);
+            break;
+        case BT_SWAP:
+            q_swap(q);
+            break;
+        case BT_SHUFFLE: {
+            int window = bt_get_int(r);
+            if (q && !q_is_ring(q))
+                q_shuffle(q, q_size(q), window);
+            break;
+        }
+        case BT_COMPACT:
+            q_compact(q);
+            break;
+        case BT_MERGE:
+            if (chain_size)
+                q_merge(&chain);
+            break;
+        }
+    }
+
+    free(buf);
+    return !r->bad;
+}
+
+/*
+ * Replay the binary trace in file fname, see bintrace.h and -r.
+ * Records go straight to the queue functions, without the checks of the
+ * commands that made them, so the run measures the queue code alone.
+ */
+static bool replay_trace(char *fname)
+{
+    bt_reader_t r;
+    if (!bt_load(&r, fname)) {
+        report(1, "ERROR: Could not load binary trace '%s'", fname);
+        return false;
+    }
+
+    /* Shuffles draw the same numbers on every replay */
+    srand(1);
+    fail_probability = 0;
+
+    size_t nops = 0;
+    bool ok = false;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (exception_setup(false))
+        ok = replay_ops(&r, &nops);
+    exception_cancel();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!ok)
+        report(1, "ERROR: Replay stopped at record %zu", nops);
+
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    report(1, "Replayed %zu operations in %.3f s, %.0f ops/sec", nops, secs,
+           nops / secs);
+
+    bt_unload(&r);
+    return ok;
+}
+
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-r RFILE][-b BFILE]"
+        "[-j JFILE][-p PORT]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-r RFILE   Record queue operations to binary trace RFILE\n");
+    printf("\t-b BFILE   Replay binary trace BFILE instead of commands\n");
+    printf("\t-j JFILE   Write command latency statistics to JFILE at exit\n");
+    printf("\t-p PORT    Serve commands to TCP clients on local PORT, after "
+           "IFILE if given\n");
     exit(0);
 }
 
@@ -1266,10 +3163,16 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char rbuf[BUFSIZE];
+    char *recfile_name = NULL;
+    char bbuf[BUFSIZE];
+    char *binfile_name = NULL;
+    char jbuf[BUFSIZE];
     int level = 4;
+    int port = 0;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:r:b:j:p:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1294,6 +3197,31 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'r':
+            strncpy(rbuf, optarg, BUFSIZE);
+            rbuf[BUFSIZE - 1] = '\0';
+            recfile_name = rbuf;
+            break;
+        case 'b':
+            strncpy(bbuf, optarg, BUFSIZE);
+            bbuf[BUFSIZE - 1] = '\0';
+            binfile_name = bbuf;
+            break;
+        case 'j':
+            strncpy(jbuf, optarg, BUFSIZE);
+            jbuf[BUFSIZE - 1] = '\0';
+            set_stats_file(jbuf);
+            break;
+        case 'p': {
+            char *endptr;
+            errno = 0;
+            port = strtol(optarg, &endptr, 10);
+            if (errno != 0 || *endptr || port < 1 || port > 65535) {
+                fprintf(stderr, "Invalid port '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1321,10 +3249,27 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(queue_quit);
+    set_session_hooks(session_save, session_restore);
+
+    if (recfile_name && !bt_record_open(recfile_name)) {
+        fprintf(stderr, "Could not open binary trace '%s'\n", recfile_name);
+        exit(EXIT_FAILURE);
+    }
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (binfile_name)
+        ok = ok && replay_trace(binfile_name);
+    else if (port)
+        ok = ok && (!infile_name || run_console(infile_name)) &&
+             run_server(port);
+    else
+        ok = ok && run_console(infile_name);
     ok = ok && finish_cmd();
 
+    if (!bt_record_close()) {
+        report(1, "ERROR: Could not write binary trace '%s'", recfile_name);
+        ok = false;
+    }
+
     return ok ? 0 : 1;
 }
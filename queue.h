@@ -10,7 +10,10 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "list.h"
+#include "strops.h"
 
 /* Linked list element */
 typedef struct {
@@ -19,8 +22,125 @@ typedef struct {
      */
     char *value;
     struct list_head list;
+    /* First 8 bytes of value packed big-endian, see q_key_prefix() */
+    uint64_t key;
 } element_t;
 
+/*
+ * Pack the first 8 bytes of s into an integer, zero-padded past the end of
+ * the string, so that comparing two prefixes as integers orders them the
+ * same way strcmp would.
+ */
+static inline uint64_t q_key_prefix(const char *s)
+{
+    uint64_t key = 0;
+
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*s)
+            key |= (unsigned char) *s++;
+    }
+
+    return key;
+}
+
+/*
+ * Compare the values of two elements like strcmp.
+ * The cached prefixes decide most comparisons without touching the strings.
+ */
+static inline int q_element_cmp(const element_t *a, const element_t *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+
+    /* A terminator inside the prefix means both strings end there */
+    if (!(a->key & 0xff))
+        return 0;
+
+    return str_cmp(a->value + 8, b->value + 8);
+}
+
+/* Return true if two elements hold equal values */
+static inline bool q_element_eq(const element_t *a, const element_t *b)
+{
+    return a->key == b->key &&
+           (!(a->key & 0xff) || str_eq(a->value + 8, b->value + 8));
+}
+
+/*
+ * Queue context.
+ * q_new() hands out a pointer to the embedded head, so every queue operation
+ * keeps taking a struct list_head * while still reaching the cached metadata
+ * through container_of().
+ */
+typedef struct {
+    struct list_head head;
+    /* Number of elements, maintained by every operation adding or removing */
+    int size;
+    /*
+     * Ring buffer backend, see q_new_ring(), used instead of the list when
+     * slots is non-NULL. The i-th element is held at slots[(first + i) &
+     * mask], or at slots[(first - i) & mask] while reversed is set, so the
+     * capacity mask + 1 is a power of two.
+     */
+    element_t **slots;
+    unsigned int mask;
+    unsigned int first;
+    /* Set by q_reverse(), a list then being linked backward, see q_relink() */
+    bool reversed;
+} queue_t;
+
+/*
+ * Iterator over the elements of a queue, whichever backend holds them.
+ * The elements must not be added or removed during iteration.
+ */
+typedef struct {
+    struct list_head *head;
+    struct list_head *node; /* Last node visited in a linked list */
+    int index;              /* Last index visited in a ring buffer */
+    bool backward;
+    bool done;
+} q_iter_t;
+
+/*
+ * Entry in a chain of queues, see q_merge().
+ * The caller links the entries through chain and may keep its own count of
+ * the elements of q in size, the sum of str_hash() over their values in sum,
+ * and a name for the queue in id.
+ */
+typedef struct {
+    struct list_head *q;
+    struct list_head chain;
+    int size;
+    uint64_t sum;
+    int id;
+} queue_chain_t;
+
+/* Work done by the sorts of one thread, see q_sort_stats() */
+typedef struct {
+    uint64_t compares;     /* Comparisons of two elements */
+    uint64_t runs;         /* Natural runs the merge sort cut lists into */
+    uint64_t merges;       /* Merges of two sorted lists */
+    uint64_t max_pending;  /* Most runs waiting to be merged at once */
+    uint64_t radix_passes; /* Radix sort passes moving every element */
+} q_sort_stats_t;
+
+/* Ways q_insert_head and q_insert_tail can allocate an element */
+enum {
+    Q_ALLOC_MALLOC, /* Element and string are two separate blocks */
+    Q_ALLOC_POOL,   /* Elements and short strings come from shared slabs */
+    Q_ALLOC_INLINE, /* String is stored in the same block, right after it */
+    Q_ALLOC_INTERN, /* Equal strings share one copy, which is never written */
+};
+
+/*
+ * Select the allocation mode used by subsequent insertions.
+ * Return true if successful.
+ * Return false if mode is unknown, or if it differs from the current mode
+ * while some elements are still allocated.
+ */
+bool q_set_alloc_mode(int mode);
+
 /* Operations on queue */
 
 /*
@@ -29,6 +149,44 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/*
+ * Create empty queue keeping its elements in a growable ring buffer of
+ * element handles instead of a linked list. Every operation below works on
+ * either kind of queue, but the elements of a ring queue are not linked
+ * together, so it must not be walked through the list nodes; use q_iter_*.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_ring();
+
+/* Return true if queue was created by q_new_ring */
+bool q_is_ring(struct list_head *head);
+
+/*
+ * Start iterating over the queue from its head, or from its tail if backward
+ * is set.
+ */
+void q_iter_init(q_iter_t *it, struct list_head *head, bool backward);
+
+/*
+ * Return the next element, or NULL once the walk has come back to the head
+ * of the queue or has run into a NULL link.
+ */
+element_t *q_iter_next(q_iter_t *it);
+
+/*
+ * Return true if an iteration that returned NULL got back to the head of the
+ * queue, false if it stopped at a broken link.
+ */
+bool q_iter_complete(const q_iter_t *it);
+
+/*
+ * Link the nodes of a list queue in queue order, from head->next to
+ * head->prev. q_reverse() only marks a list as reversed, and every operation
+ * here honors the mark, but code walking the nodes itself must call this
+ * first. No effect on a ring queue, or if q is NULL.
+ */
+void q_relink(struct list_head *head);
+
 /*
  * Free ALL storage used by queue.
  * No effect if q is NULL
@@ -53,12 +211,30 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/*
+ * Insert n elements at head of queue, with the same result as n calls to
+ * q_insert_head, the i-th inserted element holding a copy of s[i % cnt]:
+ * pass cnt == 1 to repeat one string, or cnt == n for an array of strings.
+ * Elements are linked into a private chain and spliced onto the queue at once,
+ * and in Q_ALLOC_POOL mode the whole batch is carved out of single slabs.
+ * Return the number of elements inserted, which is less than n if q is NULL
+ * or could not allocate space.
+ */
+int q_insert_head_bulk(struct list_head *head, char *const *s, int cnt, int n);
+
+/*
+ * Insert n elements at tail of queue, as n calls to q_insert_tail would.
+ * Other attribute is as same as q_insert_head_bulk.
+ */
+int q_insert_tail_bulk(struct list_head *head, char *const *s, int cnt, int n);
+
 /*
  * Attempt to remove element from head of queue.
  * Return target element.
  * Return NULL if queue is NULL or empty.
  * If sp is non-NULL and an element is removed, copy the removed string to *sp
- * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ * (up to a maximum of bufsize-1 characters, plus a null terminator; the rest
+ * of sp is left untouched.)
  *
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
@@ -75,14 +251,44 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove element from head of queue without copying its string.
+ * Return target element, or NULL if queue is NULL or empty.
+ * If sp is non-NULL, *sp points at the element's own string, and if len is
+ * also non-NULL, *len receives its length.  The string is handed over along
+ * with the element and stays valid until q_release_element is called on it.
+ */
+element_t *q_remove_head_ref(struct list_head *head,
+                             const char **sp,
+                             size_t *len);
+
+/*
+ * Attempt to remove element from tail of queue without copying its string.
+ * Other attribute is as same as q_remove_head_ref.
+ */
+element_t *q_remove_tail_ref(struct list_head *head,
+                             const char **sp,
+                             size_t *len);
+
+/*
+ * Attempt to remove the first k elements of queue, or the last -k elements
+ * if k is negative, and append them in order to the tail of out.
+ * Return the number of elements moved, which is less than |k| if the queue
+ * is shorter, and 0 if q or out is NULL.
+ * As with q_remove_head, the elements are only unlinked, never freed.
+ */
+int q_remove_range(struct list_head *head, int k, struct list_head *out);
+
 /*
  * Attempt to release element.
+ * Storage goes back the way the current allocation mode obtained it.
  */
 void q_release_element(element_t *e);
 
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
+ * Runs in constant time by reading the count cached in queue_t.
  */
 int q_size(struct list_head *head);
 
@@ -108,6 +314,15 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/*
+ * Delete all nodes that have duplicate string, without assuming that list is
+ * sorted, leaving the distinct strings in their original order.
+ * Runs in linear time with the help of a temporary hash table.
+ * Return true if successful.
+ * Return false if list is NULL or the table could not be allocated.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
 /*
  * Attempt to swap every two adjacent nodes.
  *
@@ -121,9 +336,20 @@ void q_swap(struct list_head *head);
  * This function should not allocate or free any list elements
  * (e.g., by calling q_insert_head, q_insert_tail, or q_remove_head).
  * It should rearrange the existing ones.
+ * Takes constant time, since the nodes are only relinked by q_relink().
  */
 void q_reverse(struct list_head *head);
 
+/*
+ * Reallocate the elements of queue and their strings in queue order, then
+ * release the old ones, so that walking the queue reads memory sequentially.
+ * In Q_ALLOC_POOL mode the copies come from fresh slabs holding nothing else.
+ * Return true if successful.
+ * Return false if q is NULL or an allocation failed, in which case the
+ * elements not reached yet keep their old storage.
+ */
+bool q_compact(struct list_head *head);
+
 /*
  * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
@@ -131,4 +357,79 @@ void q_reverse(struct list_head *head);
  */
 void q_sort(struct list_head *head);
 
+/*
+ * Sort elements of queue in ascending order, like q_sort, splitting the work
+ * across up to threads threads. Small queues are sorted by q_sort directly.
+ * Worker threads neither allocate nor free memory, and a pending time limit
+ * signal is only delivered once the queue has been put back together.
+ */
+void q_sort_parallel(struct list_head *head, int threads);
+
+/*
+ * Copy to stats the work done by the sorts called from this thread since the
+ * previous call, and start counting again from zero. The work of the worker
+ * threads of q_sort_parallel is counted for its caller.
+ */
+void q_sort_stats(q_sort_stats_t *stats);
+
+/*
+ * Keep scratch space for sorting queues of up to n elements allocated across
+ * sorts, until the last element is released or this is called with n of 0.
+ * Sorts never allocate: large queues are radix sorted in this space, and
+ * merge sorted if it is too small.
+ * Return true if successful.
+ * Return false if could not allocate space.
+ */
+bool q_sort_reserve(size_t n);
+
+/*
+ * Merge all the queues in the chain at head, each sorted in ascending order,
+ * into the first queue of the chain, leaving the other queues empty.
+ * Elements comparing equal keep the order of the queues they came from.
+ * Takes O(n log k) time for n elements in k queues.
+ * Return the number of elements in the first queue, 0 if head is NULL or
+ * empty, or -1 if could not allocate space, in which case no queue is
+ * changed.
+ */
+int q_merge(struct list_head *head);
+
+/*
+ * Concurrent queue.
+ *
+ * A bounded lock-free queue that any number of threads can insert into and
+ * remove from at the same time. Elements are allocated by whichever thread
+ * inserts them, so the harness has to be in thread-safe mode, and they
+ * cannot come from the pools of Q_ALLOC_POOL or the table of Q_ALLOC_INTERN,
+ * which are not shared safely.
+ */
+typedef struct q_mpmc q_mpmc_t;
+
+/*
+ * Create empty concurrent queue holding up to capacity elements, rounded up
+ * to a power of two.
+ * Return NULL if capacity is not positive, in Q_ALLOC_POOL or Q_ALLOC_INTERN
+ * mode, or if could not allocate space.
+ */
+q_mpmc_t *q_mpmc_new(int capacity);
+
+/*
+ * Free concurrent queue and every element left in it.
+ * No other thread may be using the queue.
+ */
+void q_mpmc_free(q_mpmc_t *q);
+
+/*
+ * Attempt to insert element at tail of concurrent queue.
+ * May be called from any number of threads at once.
+ * Return false if q is NULL, is full, or could not allocate space.
+ */
+bool q_mpmc_insert_tail(q_mpmc_t *q, char *s);
+
+/*
+ * Attempt to remove element from head of concurrent queue.
+ * May be called from any number of threads at once.
+ * Return NULL if q is NULL or empty, otherwise as q_remove_head.
+ */
+element_t *q_mpmc_remove_head(q_mpmc_t *q, char *sp, size_t bufsize);
+
 #endif /* LAB0_QUEUE_H */
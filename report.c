@@ -50,6 +50,11 @@ bool set_logfile(char *file_name)
     return logfile != NULL;
 }
 
+void set_report_file(FILE *f)
+{
+    init_files(f ? f : stdout, f ? f : stdout);
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -4,6 +4,9 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import json
+import os
+import tempfile
 
 
 
@@ -17,6 +20,8 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    statsFile = None
+    stats = {}
 
     traceDict = {
         1: "trace-01-ops",
@@ -69,13 +74,16 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 statsFile=None):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.statsFile = statsFile
+        self.stats = {}
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -89,12 +97,25 @@ class Tracer:
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.statsFile:
+            # Collect the latency statistics qtest writes when quitting
+            fd, jname = tempfile.mkstemp(suffix=".json")
+            os.close(fd)
+            clist += ["-j", jname]
 
         try:
             retcode = subprocess.call(clist)
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
             return False
+        finally:
+            if self.statsFile:
+                try:
+                    with open(jname) as f:
+                        self.stats[self.traceDict[tid]] = json.load(f)
+                except ValueError:
+                    pass
+                os.remove(jname)
         return retcode == 0
 
     def run(self, tid=0):
@@ -142,16 +163,20 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
+        if self.statsFile:
+            with open(self.statsFile, "w") as f:
+                json.dump({"traces": self.stats}, f, indent=2)
         if score < maxscore:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c] [-j FILE]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -j FILE   Collect latency statistics of every trace into FILE as JSON")
     sys.exit(0)
 
 
@@ -163,8 +188,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    statsFile = None
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cj:', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +207,8 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-j':
+            statsFile = val
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +218,8 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               statsFile=statsFile)
     t.run(tid)
 
 
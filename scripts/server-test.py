@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+
+# Scripted clients checking the command server of qtest -p
+
+from __future__ import print_function
+import getopt
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+qtest = "./qtest"
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        print("ERROR: %s" % what)
+        failures += 1
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def connect(port, timeout=5):
+    deadline = time.time() + timeout
+    while True:
+        try:
+            return Client(socket.create_connection(("127.0.0.1", port)))
+        except OSError:
+            if time.time() > deadline:
+                raise
+            time.sleep(0.05)
+
+
+class Client:
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.sock.settimeout(5)
+        self.data = b""
+
+    def send(self, *lines):
+        self.sock.sendall("".join(l + "\n" for l in lines).encode())
+
+    # Return the output of the next n commands, each ending with OK or FAIL
+    def results(self, n):
+        out = []
+        while len(out) < n:
+            lines = self.data.split(b"\n")
+            for i, line in enumerate(lines[:-1]):
+                if line in (b"OK", b"FAIL"):
+                    out.append((b"\n".join(lines[:i]).decode(),
+                                line.decode()))
+                    self.data = b"\n".join(lines[i + 1:])
+                    break
+            else:
+                d = self.sock.recv(65536)
+                if not d:
+                    break
+                self.data += d
+        return out
+
+    # Return whether the server closed the connection, with nothing more sent
+    def closed(self):
+        try:
+            return not self.data and not self.sock.recv(65536)
+        except ConnectionResetError:
+            return not self.data
+        except OSError:
+            return False
+
+    def close(self):
+        self.sock.close()
+
+
+def test_pipelining(port):
+    c = connect(port)
+    c.send("new", "ih a 3", "rh a", "size", "nosuchcmd", "it b")
+    res = c.results(6)
+    check([r[1] for r in res] == ["OK"] * 4 + ["FAIL", "OK"],
+          "pipelined commands got statuses %s" % [r[1] for r in res])
+    check(len(res) > 3 and "Queue size = 2" in res[3][0],
+          "pipelined size did not see the earlier commands")
+    c.close()
+
+
+def test_selection(port):
+    a, b = connect(port), connect(port)
+    a.send("new", "it a1")
+    a.results(2)
+    b.send("new", "it b1")
+    b.results(2)
+    a.send("show")
+    b.send("show")
+    sa, sb = a.results(1), b.results(1)
+    check(sa and "[a1]" in sa[0][0], "first client lost its queue: %s" % sa)
+    check(sb and "[b1]" in sb[0][0], "second client lost its queue: %s" % sb)
+    a.close()
+    b.close()
+
+
+def test_quit(port):
+    a, b = connect(port), connect(port)
+    a.send("new")
+    a.results(1)
+    b.send("new", "quit", "show")
+    res = b.results(3)
+    check([r[1] for r in res] == ["OK", "OK"],
+          "quit got statuses %s" % [r[1] for r in res])
+    check(b.closed(), "quit did not close the connection")
+    a.send("it x", "size")
+    res = a.results(2)
+    check([r[1] for r in res] == ["OK", "OK"],
+          "quit of one client stopped another")
+    a.close()
+    b.close()
+
+
+def test_quit_before_serving():
+    fd, name = tempfile.mkstemp(suffix=".cmd")
+    os.write(fd, b"new\nquit\n")
+    os.close(fd)
+    try:
+        r = subprocess.run([qtest, "-f", name, "-p", str(free_port())],
+                           stdout=subprocess.PIPE,
+                           stderr=subprocess.STDOUT,
+                           timeout=5)
+        check(b"Not serving" in r.stdout,
+              "server started after quit in the command file")
+    except subprocess.TimeoutExpired:
+        check(False, "server started after quit in the command file")
+    finally:
+        os.remove(name)
+
+
+def test_quit_in_source():
+    fd, name = tempfile.mkstemp(suffix=".cmd")
+    os.write(fd, b"new\nquit\nsize\n")
+    os.close(fd)
+    port = free_port()
+    server = subprocess.Popen([qtest, "-p", str(port)],
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.STDOUT)
+    try:
+        a = connect(port)
+        b = connect(port)
+        a.send("new")
+        a.results(1)
+        b.send("source " + name, "show")
+        res = b.results(2)
+        check([r[1] for r in res] == ["OK"],
+              "quit in a sourced file got statuses %s" % [r[1] for r in res])
+        check(b.closed(), "quit in a sourced file did not close the connection")
+        out = server.communicate(timeout=5)[0]
+        check(b"Stopped serving" in out,
+              "server did not stop after quit in a sourced file")
+        check(a.closed(), "other client kept its connection after quit")
+        a.close()
+        b.close()
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.communicate()
+        check(False, "server kept serving after quit in a sourced file")
+    except OSError as e:
+        server.kill()
+        server.communicate()
+        check(False, "test_quit_in_source: %s" % e)
+    finally:
+        os.remove(name)
+
+
+def run(name, args):
+    global qtest
+    optlist, args = getopt.getopt(args, "hp:")
+    for (opt, val) in optlist:
+        if opt == "-h":
+            print("Usage: %s [-h] [-p PROG]" % name)
+            print("  -h        Print this message")
+            print("  -p PROG   Program to test")
+            sys.exit(0)
+        elif opt == "-p":
+            qtest = val
+
+    port = free_port()
+    server = subprocess.Popen([qtest, "-p", str(port)],
+                              stdout=subprocess.DEVNULL)
+    try:
+        for test in (test_pipelining, test_selection, test_quit):
+            try:
+                test(port)
+            except OSError as e:
+                check(False, "%s: %s" % (test.__name__, e))
+    finally:
+        server.send_signal(signal.SIGTERM)
+        try:
+            server.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            server.kill()
+            check(False, "server did not stop on SIGTERM")
+    test_quit_before_serving()
+    test_quit_in_source()
+
+    if failures:
+        print("%d server checks failed" % failures)
+        sys.exit(1)
+    print("All server checks passed")
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
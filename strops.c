@@ -0,0 +1,353 @@
+#include <string.h>
+
+#include "strops.h"
+
+#if !defined(STROPS_SCALAR) && defined(__x86_64__)
+#include <immintrin.h>
+#define STROPS_X86 1
+#elif !defined(STROPS_SCALAR) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STROPS_NEON 1
+#endif
+
+/*
+ * The vector kernels deliberately load whole blocks beyond the terminator,
+ * which is safe as long as no load crosses into the next page.
+ */
+#define STR_PAGE_SIZE 4096
+#define NO_ASAN __attribute__((no_sanitize_address))
+
+static inline bool crosses_page(const char *p, size_t n)
+{
+    return ((uintptr_t) p & (STR_PAGE_SIZE - 1)) > STR_PAGE_SIZE - n;
+}
+
+/*
+ * The hash consumes 32-byte stripes as four 64-bit lanes, each lane
+ * accumulating lo32(d ^ k) * hi32(d ^ k) + d for its word d, in the manner
+ * of XXH3.  A final partial stripe is padded with zeros, and the rotated
+ * lanes are folded together and mixed by str_mix64().
+ */
+#define HASH_STRIPE 32
+
+static const uint64_t hash_secret[4] = {
+    0xbe4ba423396cfeb8ULL,
+    0x1cad21f72c81017cULL,
+    0xdb979083e96dd4deULL,
+    0x1f67b3b7a4a44072ULL,
+};
+
+static inline uint64_t hash_finish(const uint64_t acc[4], size_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < 4; i++)
+        h ^= acc[i] << (16 * i) | acc[i] >> ((64 - 16 * i) & 63);
+    return str_mix64(h);
+}
+
+/* Scalar kernels */
+
+static size_t len_scalar(const char *s)
+{
+    return strlen(s);
+}
+
+static size_t mismatch_scalar(const char *a, const char *b)
+{
+    size_t i = 0;
+    while (a[i] && a[i] == b[i])
+        i++;
+    return i;
+}
+
+static inline void stripe_scalar(uint64_t acc[4], const char *p)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t d;
+        memcpy(&d, p + 8 * i, 8);
+        uint64_t dk = d ^ hash_secret[i];
+        acc[i] += (dk & 0xffffffff) * (dk >> 32) + d;
+    }
+}
+
+static uint64_t hash_scalar(const char *s)
+{
+    size_t len = strlen(s), n = len;
+    uint64_t acc[4];
+    memcpy(acc, hash_secret, sizeof(acc));
+
+    for (; n >= HASH_STRIPE; n -= HASH_STRIPE, s += HASH_STRIPE)
+        stripe_scalar(acc, s);
+    if (n) {
+        char buf[HASH_STRIPE] = {0};
+        memcpy(buf, s, n);
+        stripe_scalar(acc, buf);
+    }
+
+    return hash_finish(acc, len);
+}
+
+#ifdef STROPS_X86
+
+/* SSE2 kernels, available on every x86-64 CPU */
+
+NO_ASAN static size_t len_sse2(const char *s)
+{
+    /* Aligned loads never cross a page */
+    size_t off = (uintptr_t) s & 15;
+    const char *p = s - off;
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i v = _mm_load_si128((const void *) p);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) >> off;
+    if (mask)
+        return __builtin_ctz(mask);
+
+    for (p += 16;; p += 16) {
+        mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_load_si128((const void *) p), zero));
+        if (mask)
+            return p - s + __builtin_ctz(mask);
+    }
+}
+
+NO_ASAN static size_t mismatch_sse2(const char *a, const char *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (;;) {
+        if (crosses_page(a + i, 16) || crosses_page(b + i, 16)) {
+            if (!a[i] || a[i] != b[i])
+                return i;
+            i++;
+            continue;
+        }
+
+        __m128i va = _mm_loadu_si128((const void *) (a + i));
+        __m128i vb = _mm_loadu_si128((const void *) (b + i));
+        unsigned mask = (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff) |
+                        _mm_movemask_epi8(_mm_cmpeq_epi8(va, zero));
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+}
+
+static inline __m128i stripe_sse2(__m128i acc,
+                                  const char *p,
+                                  const uint64_t *secret)
+{
+    __m128i d = _mm_loadu_si128((const void *) p);
+    __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const void *) secret));
+    __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+    return _mm_add_epi64(acc, _mm_add_epi64(prod, d));
+}
+
+static uint64_t hash_sse2(const char *s)
+{
+    size_t len = len_sse2(s), n = len;
+    __m128i acc0 = _mm_loadu_si128((const void *) hash_secret);
+    __m128i acc1 = _mm_loadu_si128((const void *) (hash_secret + 2));
+
+    for (; n >= HASH_STRIPE; n -= HASH_STRIPE, s += HASH_STRIPE) {
+        acc0 = stripe_sse2(acc0, s, hash_secret);
+        acc1 = stripe_sse2(acc1, s + 16, hash_secret + 2);
+    }
+    if (n) {
+        char buf[HASH_STRIPE] = {0};
+        memcpy(buf, s, n);
+        acc0 = stripe_sse2(acc0, buf, hash_secret);
+        acc1 = stripe_sse2(acc1, buf + 16, hash_secret + 2);
+    }
+
+    uint64_t acc[4];
+    _mm_storeu_si128((void *) acc, acc0);
+    _mm_storeu_si128((void *) (acc + 2), acc1);
+    return hash_finish(acc, len);
+}
+
+/* AVX2 kernels, selected when the CPU reports AVX2 support */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 NO_ASAN static size_t len_avx2(const char *s)
+{
+    size_t off = (uintptr_t) s & 31;
+    const char *p = s - off;
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i v = _mm256_load_si256((const void *) p);
+    unsigned mask =
+        (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) >> off;
+    if (mask)
+        return __builtin_ctz(mask);
+
+    for (p += 32;; p += 32) {
+        mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_load_si256((const void *) p), zero));
+        if (mask)
+            return p - s + __builtin_ctz(mask);
+    }
+}
+
+AVX2 NO_ASAN static size_t mismatch_avx2(const char *a, const char *b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (;;) {
+        if (crosses_page(a + i, 32) || crosses_page(b + i, 32)) {
+            if (!a[i] || a[i] != b[i])
+                return i;
+            i++;
+            continue;
+        }
+
+        __m256i va = _mm256_loadu_si256((const void *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const void *) (b + i));
+        unsigned mask =
+            ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) |
+            (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, zero));
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+}
+
+AVX2 static inline __m256i stripe_avx2(__m256i acc, const char *p)
+{
+    __m256i d = _mm256_loadu_si256((const void *) p);
+    __m256i dk =
+        _mm256_xor_si256(d, _mm256_loadu_si256((const void *) hash_secret));
+    __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+    return _mm256_add_epi64(acc, _mm256_add_epi64(prod, d));
+}
+
+AVX2 static uint64_t hash_avx2(const char *s)
+{
+    size_t len = len_avx2(s), n = len;
+    __m256i acc_v = _mm256_loadu_si256((const void *) hash_secret);
+
+    for (; n >= HASH_STRIPE; n -= HASH_STRIPE, s += HASH_STRIPE)
+        acc_v = stripe_avx2(acc_v, s);
+    if (n) {
+        char buf[HASH_STRIPE] = {0};
+        memcpy(buf, s, n);
+        acc_v = stripe_avx2(acc_v, buf);
+    }
+
+    uint64_t acc[4];
+    _mm256_storeu_si256((void *) acc, acc_v);
+    return hash_finish(acc, len);
+}
+
+#endif /* STROPS_X86 */
+
+#ifdef STROPS_NEON
+
+/*
+ * NEON kernels.  A byte mask is narrowed to four bits per byte, so the
+ * index of the first set byte is the trailing zero count divided by 4.
+ */
+
+static inline uint64_t neon_mask(uint8x16_t v)
+{
+    return vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0);
+}
+
+NO_ASAN static size_t len_neon(const char *s)
+{
+    size_t off = (uintptr_t) s & 15;
+    const char *p = s - off;
+
+    uint64_t mask = neon_mask(vceqzq_u8(vld1q_u8((const uint8_t *) p))) >>
+                    (off * 4);
+    if (mask)
+        return __builtin_ctzll(mask) >> 2;
+
+    for (p += 16;; p += 16) {
+        mask = neon_mask(vceqzq_u8(vld1q_u8((const uint8_t *) p)));
+        if (mask)
+            return p - s + (__builtin_ctzll(mask) >> 2);
+    }
+}
+
+NO_ASAN static size_t mismatch_neon(const char *a, const char *b)
+{
+    size_t i = 0;
+
+    for (;;) {
+        if (crosses_page(a + i, 16) || crosses_page(b + i, 16)) {
+            if (!a[i] || a[i] != b[i])
+                return i;
+            i++;
+            continue;
+        }
+
+        uint8x16_t va = vld1q_u8((const uint8_t *) (a + i));
+        uint8x16_t vb = vld1q_u8((const uint8_t *) (b + i));
+        uint64_t mask =
+            neon_mask(vorrq_u8(vmvnq_u8(vceqq_u8(va, vb)), vceqzq_u8(va)));
+        if (mask)
+            return i + (__builtin_ctzll(mask) >> 2);
+        i += 16;
+    }
+}
+
+static inline uint64x2_t stripe_neon(uint64x2_t acc,
+                                     const char *p,
+                                     const uint64_t *secret)
+{
+    uint64x2_t d = vreinterpretq_u64_u8(vld1q_u8((const uint8_t *) p));
+    uint64x2_t dk = veorq_u64(d, vld1q_u64(secret));
+    uint64x2_t prod = vmull_u32(vmovn_u64(dk), vshrn_n_u64(dk, 32));
+    return vaddq_u64(acc, vaddq_u64(prod, d));
+}
+
+static uint64_t hash_neon(const char *s)
+{
+    size_t len = len_neon(s), n = len;
+    uint64x2_t acc0 = vld1q_u64(hash_secret);
+    uint64x2_t acc1 = vld1q_u64(hash_secret + 2);
+
+    for (; n >= HASH_STRIPE; n -= HASH_STRIPE, s += HASH_STRIPE) {
+        acc0 = stripe_neon(acc0, s, hash_secret);
+        acc1 = stripe_neon(acc1, s + 16, hash_secret + 2);
+    }
+    if (n) {
+        char buf[HASH_STRIPE] = {0};
+        memcpy(buf, s, n);
+        acc0 = stripe_neon(acc0, buf, hash_secret);
+        acc1 = stripe_neon(acc1, buf + 16, hash_secret + 2);
+    }
+
+    uint64_t acc[4];
+    vst1q_u64(acc, acc0);
+    vst1q_u64(acc + 2, acc1);
+    return hash_finish(acc, len);
+}
+
+#endif /* STROPS_NEON */
+
+/* Scalar until str_kernel_init() has run */
+str_kernel_t str_kernel = {"scalar", len_scalar, mismatch_scalar,
+                           hash_scalar};
+
+/*
+ * Select the kernels before main() runs, so that threads sorting in parallel
+ * never race on the selection.
+ */
+__attribute__((constructor)) static void str_kernel_init(void)
+{
+#if defined(STROPS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        str_kernel = (str_kernel_t){"avx2", len_avx2, mismatch_avx2, hash_avx2};
+    else
+        str_kernel = (str_kernel_t){"sse2", len_sse2, mismatch_sse2, hash_sse2};
+#elif defined(STROPS_NEON)
+    str_kernel = (str_kernel_t){"neon", len_neon, mismatch_neon, hash_neon};
+#endif
+}
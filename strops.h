@@ -0,0 +1,68 @@
+#ifndef LAB0_STROPS_H
+#define LAB0_STROPS_H
+
+/*
+ * String kernels for the short null-terminated values kept in queues.
+ *
+ * Each kernel set is a scalar, SSE2, AVX2 (x86-64) or NEON (Arm64)
+ * implementation of the same operations, and the best one the CPU supports
+ * is selected once at startup.  All of them compute identical results, so
+ * hashes do not depend on the machine.
+ *
+ * The vector kernels may read past the terminator of a string, but never
+ * into the next page, the same way optimized C library string functions do.
+ * Build with SIMD=0 to use only the scalar kernels, e.g. under Valgrind.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char *name;
+    /* Return the length of s, as strlen(s) would */
+    size_t (*len)(const char *s);
+    /*
+     * Return the index of the first byte in which a and b differ, or of
+     * their common terminator if they are equal
+     */
+    size_t (*mismatch)(const char *a, const char *b);
+    /* Return a 64-bit hash of s */
+    uint64_t (*hash)(const char *s);
+} str_kernel_t;
+
+/* Kernel set in use */
+extern str_kernel_t str_kernel;
+
+/* Compare a and b in the same way as strcmp */
+static inline int str_cmp(const char *a, const char *b)
+{
+    size_t i = str_kernel.mismatch(a, b);
+    return (unsigned char) a[i] - (unsigned char) b[i];
+}
+
+/* Return true if a and b are equal */
+static inline bool str_eq(const char *a, const char *b)
+{
+    size_t i = str_kernel.mismatch(a, b);
+    return a[i] == b[i];
+}
+
+/* Mix 64 bits so that every input bit affects every output bit */
+static inline uint64_t str_mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Return a 64-bit hash of s, identical whichever kernel set is in use */
+static inline uint64_t str_hash(const char *s)
+{
+    return str_kernel.hash(s);
+}
+
+#endif /* LAB0_STROPS_H */
@@ -12,6 +12,7 @@ it tiger
 rt tiger
 dm
 dm
+size
 it meerkat
 rh dolphin
 rh bear
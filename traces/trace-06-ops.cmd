@@ -5,4 +5,5 @@ it gerbil 3
 it lion 2
 it zebra 2
 sort
-dedup
\ No newline at end of file
+dedup
+size
\ No newline at end of file
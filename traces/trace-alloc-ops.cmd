@@ -0,0 +1,40 @@
+# Test of pooled and inline element allocation
+option fail 0
+option malloc 0
+option alloc 1
+new
+ih RAND 1000
+it aardvark_bear_dolphin_gerbil_jaguar 5
+it gerbil 3
+shuffle
+sort
+dedup
+rh
+rt
+dm
+size
+reverse
+swap
+free
+option alloc 2
+new
+ih bear 3
+it meerkat_panda_squirrel_vulture_wolf 2
+shuffle
+sort
+dedup
+it meerkat_panda_squirrel_vulture_wolf
+option length 7
+rh meerkat
+option length 1024
+size
+free
+# Switching mode is rejected while elements are allocated
+new
+ih dolphin
+option alloc 0
+free
+option alloc 0
+new
+ih dolphin
+rh dolphin
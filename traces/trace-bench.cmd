@@ -0,0 +1,3 @@
+# Time queue operations at sizes from 1K to 4M elements, and check how
+# the time per call grows with the size
+bench bench.json
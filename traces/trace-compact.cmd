@@ -0,0 +1,34 @@
+# Test compaction of queues in every allocation mode
+option fail 10
+new
+it dolphin 20000
+it a_string_too_long_for_the_string_pool 10000
+shuffle
+sort
+compact
+free
+option alloc 1
+new
+ih gerbil 20000
+it a_string_too_long_for_the_string_pool 10000
+shuffle
+sort
+compact
+reverse
+compact
+free
+option alloc 2
+new ring
+ih bear 10000
+reverse
+compact
+sort
+free
+option alloc 0
+new
+ih meerkat 1000
+option malloc 50
+compact
+compact
+option malloc 0
+free
@@ -0,0 +1,26 @@
+# Test of removing duplicates from an unsorted queue by hashing
+option hashdedup 1
+new
+it dolphin
+it abcdefghij
+it bear
+it abcdefghik
+it dolphin
+it gerbil
+it abcdefghij
+it bear
+it zebra
+it abcdefghijklmnopqrs
+it dolphin
+dedup
+rh abcdefghik
+rh gerbil
+rh zebra
+rh abcdefghijklmnopqrs
+dedup
+size
+it RAND 100000
+it RAND 100000
+dedup
+size
+free
@@ -0,0 +1,7 @@
+# Test if the time of q_swap and q_delete_mid grows linearly, and of q_sort as
+# n log n
+option simulation 1
+swap
+dm
+sort
+option simulation 0
@@ -0,0 +1,38 @@
+# Test sharing of equal strings between elements
+option alloc 3
+new
+ih dolphin 100000
+it gerbil 100000
+ih RAND 1000
+it a_string_long_enough_to_need_more_than_one_word 1000
+rh
+rt a_string_long_enough_to_need_more_than_one_word
+rhn 500
+rtn 500
+sort
+dedup
+free
+new
+ih bear 3
+it meerkat 2
+ih bear
+option hashdedup 1
+dedup
+option hashdedup 0
+size
+new ring
+it gerbil 5000
+ih dolphin 5000
+compact
+sort
+dedup
+merge
+free
+free
+option fail 30
+new
+option malloc 20
+ih RAND 20
+it dolphin 20
+option malloc 0
+free
@@ -0,0 +1,66 @@
+# Test operations on queues left reversed by reverse
+option validate 1
+new
+it RAND 10000
+reverse
+ih dolphin 100
+it gerbil 100
+rhn 50
+rtn 50
+dm
+swap
+compact
+reverse
+sort
+reverse
+linux_sort
+reverse
+shuffle 16
+reverse
+option threads 4
+sort
+new
+it zebra
+it yak
+it xerus
+reverse
+new
+ih RAND 20000
+sort
+merge
+reverse
+dedup
+free
+free
+free
+new
+it a
+it b
+it c
+it d
+it e
+reverse
+swap
+rh d
+rh e
+it f
+ih g
+dm
+rt f
+rh g
+reverse
+it c
+rhn 1
+rh b
+ih a
+ih z
+reverse
+it y
+rtn 1
+rt z
+it a
+sort
+reverse
+dedup
+rh c
+free
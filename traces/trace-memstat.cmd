@@ -0,0 +1,21 @@
+# Test allocation profile of each element allocation mode
+new
+ih dolphin 1000
+option memprof 1
+it gerbil 10000
+rh dolphin
+memstat
+memstat reset
+free
+memstat
+option alloc 2
+new
+ih a_rather_long_string_kept_inline 10000
+sort
+memstat
+free
+option alloc 1
+new
+ih pooled 10000
+memstat
+free
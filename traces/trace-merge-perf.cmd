@@ -0,0 +1,69 @@
+# Test performance of merging 16 sorted queues of 100000 elements
+option fail 0
+option malloc 0
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+merge
+size
+free
+free
+free
+free
+free
+free
+free
+free
+free
+free
+free
+free
+free
+free
+free
+free
@@ -0,0 +1,31 @@
+# Test performance of q_sort against q_sort_parallel
+option fail 0
+option malloc 0
+new
+ih dolphin 1000000
+it gerbil 1000000
+reverse
+time sort
+reverse
+option threads 4
+time sort
+option threads 1
+free
+new
+ih RAND 500000
+time sort
+free
+new
+ih RAND 500000
+option threads 4
+time sort
+option threads 1
+free
+new
+ih RAND 500000
+option threads 16
+time sort
+reverse
+time sort
+option threads 1
+free
@@ -0,0 +1,27 @@
+# Test performance of radix sort path of q_sort against list_sort
+option fail 0
+option malloc 0
+new
+ih RAND 500000
+time sort
+reverse
+time sort
+free
+new
+ih RAND 500000
+time linux_sort
+reverse
+time linux_sort
+free
+new
+ih RAND 100000
+it aardvark_bear_dolphin_gerbil_jaguar 100000
+ih aardvark_bear_dolphin_gerbil 100000
+time sort
+free
+new
+ih RAND 100000
+it aardvark_bear_dolphin_gerbil_jaguar 100000
+ih aardvark_bear_dolphin_gerbil 100000
+time linux_sort
+free
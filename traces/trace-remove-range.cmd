@@ -0,0 +1,33 @@
+# Test of q_remove_range through rhn and rtn
+option fail 10
+new
+ih c
+ih b
+ih a
+it d
+it e
+rhn 2
+rh c
+size
+rhn 4
+size
+it RAND 100000
+rhn 99999
+size
+rhn 1
+free
+new
+it a
+it b
+it c
+it d
+it e
+rtn 2
+rt c
+rhn 1
+rh b
+it RAND 100000
+rtn 99999
+rtn 2
+size
+free
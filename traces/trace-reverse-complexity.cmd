@@ -0,0 +1,4 @@
+# Test if time complexity of q_reverse is constant
+option simulation 1
+reverse
+option simulation 0
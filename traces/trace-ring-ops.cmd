@@ -0,0 +1,41 @@
+# Test of queue operations on the ring buffer backend
+option fail 0
+option malloc 0
+new ring
+ih dolphin
+ih bear
+it gerbil
+it meerkat
+reverse
+rh meerkat
+it vulture
+ih squirrel
+rt vulture
+reverse
+swap
+rh dolphin
+rh bear
+it RAND 100
+reverse
+it wolf 40
+ih aardvark_bear_dolphin_gerbil_jaguar 3
+dm
+sort
+dedup
+rhn 20
+rtn 20
+it zebra
+it zebra
+it panda
+ih panda
+option hashdedup 1
+dedup
+option hashdedup 0
+free
+new ring
+it RAND 100000
+sort
+reverse
+sort
+size
+free
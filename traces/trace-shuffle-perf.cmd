@@ -0,0 +1,17 @@
+# Test performance of shuffle, and of sorting nearly sorted queues
+option fail 0
+option malloc 0
+new
+ih RAND 1000000
+time shuffle
+time sort
+time shuffle 16
+time sort
+time shuffle 1
+free
+new
+ih gerbil
+shuffle
+it dolphin
+shuffle 2
+size
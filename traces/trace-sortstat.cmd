@@ -0,0 +1,25 @@
+# Test sort counters, and q_sort against list_sort on one snapshot of input
+option fail 0
+option malloc 0
+sortstat
+new
+ih RAND 100000
+sortstat compare
+option sortscratch 1
+sortstat compare
+sort
+reverse
+linux_sort
+sortstat
+shuffle
+option threads 4
+sortstat compare
+free
+option sortscratch 0
+option threads 1
+new
+ih dolphin 10
+it gerbil 5
+sortstat compare
+show
+free
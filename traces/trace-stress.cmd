@@ -0,0 +1,9 @@
+# Test concurrent queue with producer and consumer threads
+option fail 10
+stress 1 1 10000
+stress 4 4 10000
+option malloc 10
+stress 2 3 2000
+option malloc 0
+option alloc 2
+stress 3 1 5000
@@ -0,0 +1,21 @@
+# Test checking of large queues after each command
+option validate 1
+new
+it RAND 50000
+ih dolphin 10000
+rh dolphin
+rtn 100
+dm
+reverse
+sort
+dedup
+option validate 4
+new
+it gerbil 20000
+merge
+swap
+size
+option validate 0
+rhn 1000
+compact
+free
@@ -0,0 +1,20 @@
+# Test rh and rt without expected values, with and without option zerocopy
+option fail 10
+new
+ih a
+it b
+rh
+rt
+rh
+option zerocopy 1
+it c
+it d
+it e
+rh
+rt
+rh d
+rh
+rt
+option zerocopy 0
+free
+rh